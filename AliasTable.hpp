@@ -0,0 +1,57 @@
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+// Walker/Vose alias table: draws index i with probability weights[i] / total in
+// O(1) from two uniform numbers, whatever the number of entries.
+struct AliasTable
+{
+    // probability of keeping bin i instead of jumping to alias[i]
+    std::vector<float> prob;
+    std::vector<uint32_t> alias;
+    double total = 0;
+
+    void build(const std::vector<float>& weights)
+    {
+        size_t n = weights.size();
+        total = 0;
+        for (float w : weights)
+            total += w;
+        prob.assign(n, 1.0f);
+        alias.resize(n);
+        for (size_t i = 0; i < n; ++i)
+            alias[i] = i;
+        if (n == 0 || total <= 0)
+            return;
+
+        // scale to mean 1, then pair every underfull bin with an overfull one
+        std::vector<double> scaled(n);
+        std::vector<uint32_t> small, large;
+        for (size_t i = 0; i < n; ++i) {
+            scaled[i] = weights[i] * n / total;
+            (scaled[i] < 1 ? small : large).push_back(i);
+        }
+        while (!small.empty() && !large.empty()) {
+            uint32_t s = small.back(), l = large.back();
+            small.pop_back();
+            large.pop_back();
+            prob[s] = scaled[s];
+            alias[s] = l;
+            scaled[l] += scaled[s] - 1;
+            (scaled[l] < 1 ? small : large).push_back(l);
+        }
+        // what is left is 1 up to rounding and keeps prob = 1
+    }
+
+    bool empty() const { return prob.empty() || total <= 0; }
+
+    // uBin in [0, 1] picks a bin, uAlias decides between the bin and its alias. Two
+    // numbers, since the fraction left of uBin * n after picking one of millions
+    // of bins has too few bits to decide the alias.
+    size_t sample(float uBin, float uAlias) const
+    {
+        size_t i = std::min(size_t(uBin * double(prob.size())), prob.size() - 1);
+        return uAlias < prob[i] ? i : alias[i];
+    }
+};
@@ -1,142 +1,643 @@
 #include <algorithm>
 #include <cassert>
+#include <chrono>
 #include "BVH.hpp"
 
-BVHAccel::BVHAccel(std::vector<Object*> p, int maxPrimsInNode,
-                   SplitMethod splitMethod)
-    : maxPrimsInNode(std::min(255, maxPrimsInNode)), splitMethod(splitMethod),
-      primitives(std::move(p))
+#if defined(__SSE__) || defined(_M_X64)
+#include <xmmintrin.h>
+#define BVH_USE_SSE
+#endif
+
+BVHAccel::BVHAccel(std::vector<Object*> p, int maxPrimsInNode, SplitMethod splitMethod)
+    : maxPrimsInNode(std::min(255, maxPrimsInNode)), splitMethod(splitMethod), leafPacketWidth(1)
 {
-    time_t start, stop;
-    time(&start);
-    if (primitives.empty())
+    if (p.empty())
         return;
 
-    root = recursiveBuild(primitives);
+    // query every primitive once, the build only works on this array
+    int n = p.size();
+    std::vector<BVHPrimitiveInfo> primitiveInfo(n);
+    parallel_for(0, n, 1024, [&](int64_t i) {
+        primitiveInfo[i] = BVHPrimitiveInfo(i, p[i]->getBounds());
+    });
+
+    std::vector<int> order = build(primitiveInfo);
+    primitives.resize(order.size());
+    for (size_t i = 0; i < order.size(); ++i)
+        primitives[i] = p[order[i]];
+}
+
+BVHAccel::BVHAccel(const TriangleMesh* mesh, Object* owner, SplitMethod splitMethod)
+    : maxPrimsInNode(TrianglePacket::width), splitMethod(splitMethod),
+      leafPacketWidth(TrianglePacket::width), mesh(mesh), owner(owner)
+{
+    int n = mesh->numFaces();
+    if (n == 0)
+        return;
 
-    time(&stop);
-    double diff = difftime(stop, start);
-    int hrs = (int)diff / 3600;
-    int mins = ((int)diff / 60) - (hrs * 60);
-    int secs = (int)diff - (hrs * 3600) - (mins * 60);
+    std::vector<BVHPrimitiveInfo> primitiveInfo(n);
+    parallel_for(0, n, 1024, [&](int64_t i) {
+        primitiveInfo[i] = BVHPrimitiveInfo(i, mesh->faceBounds(i));
+    });
 
-    printf(
-        "\rBVH Generation complete: \nTime Taken: %i hrs, %i mins, %i secs\n\n",
-        hrs, mins, secs);
+    std::vector<int> order = build(primitiveInfo);
+    // padding slots keep face 0, fillPackets leaves their lanes empty so they never hit
+    faces.resize(order.size());
+    for (size_t i = 0; i < order.size(); ++i)
+        faces[i] = std::max(order[i], 0);
+    fillPackets();
 }
 
-BVHBuildNode* BVHAccel::recursiveBuild(std::vector<Object*> objects)
+BVHAccel::BVHAccel(const TriangleMesh* mesh, Object* owner, SplitMethod splitMethod,
+                   std::vector<LinearBVHNode> nodes, std::vector<uint32_t> faces)
+    : maxPrimsInNode(TrianglePacket::width), splitMethod(splitMethod),
+      leafPacketWidth(TrianglePacket::width), mesh(mesh), owner(owner), faces(std::move(faces))
 {
-    BVHBuildNode* node = new BVHBuildNode();
+    this->nodes = std::move(nodes);
+    fillPackets();
+}
 
-    // Compute bounds of all primitives in BVH node
-    Bounds3 bounds;
-    for (int i = 0; i < objects.size(); ++i)
-        bounds = Union(bounds, objects[i]->getBounds());
-    if (objects.size() == 1) {
-        // Create leaf _BVHBuildNode_
-        node->bounds = objects[0]->getBounds();
-        node->object = objects[0];
-        node->left = nullptr;
-        node->right = nullptr;
-        node->area = objects[0]->getArea();
-        return node;
-    }
-    else if (objects.size() == 2) {
-        node->left = recursiveBuild(std::vector{objects[0]});
-        node->right = recursiveBuild(std::vector{objects[1]});
+void BVHAccel::fillPackets()
+{
+    packets.assign(faces.size() / TrianglePacket::width, TrianglePacket());
+    parallel_for(0, nodes.size(), 256, [&](int64_t i) {
+        const LinearBVHNode& node = nodes[i];
+        for (int k = 0; k < node.nPrimitives; ++k) {
+            int slot = node.primitivesOffset + k;
+            Vector3f e1, e2;
+            mesh->edges(faces[slot], e1, e2);
+            packets[slot / TrianglePacket::width].set(slot % TrianglePacket::width,
+                                                      mesh->vertex(faces[slot], 0), e1, e2);
+        }
+    });
+}
+
+std::vector<int> BVHAccel::build(std::vector<BVHPrimitiveInfo>& primitiveInfo)
+{
+    auto start = std::chrono::steady_clock::now();
+    int n = primitiveInfo.size();
+
+    // a binary tree with at least one primitive per leaf has at most 2n - 1 nodes
+    buildNodes.resize(2 * n - 1);
+    // worst case every leaf holds one primitive padded to a full packet
+    std::vector<int> orderedPrims(n * leafPacketWidth, -1);
+    root = recursiveBuild(primitiveInfo, 0, n, orderedPrims, 0);
+    orderedPrims.resize(orderedPrimsOffset);
+
+    nodes.reserve(buildNodeCount);
+    flattenBVHTree(root);
+    // traversal, the 4-wide collapse and the cost estimate all use the flattened nodes
+    root = nullptr;
+    std::vector<BVHBuildNode>().swap(buildNodes);
 
-        node->bounds = Union(node->left->bounds, node->right->bounds);
-        node->area = node->left->area + node->right->area;
-        return node;
+    auto stop = std::chrono::steady_clock::now();
+    double ms = std::chrono::duration<double, std::milli>(stop - start).count();
+
+    printf("\rBVH Generation complete (%s): %d primitives, %zu nodes, SAH cost %.2f\n"
+           "Time Taken: %.2f ms\n\n",
+           splitMethod == SplitMethod::SAH ? "SAH" : "NAIVE", n,
+           nodes.size(), SAHCost(), ms);
+    return orderedPrims;
+}
+
+BVHAccel::~BVHAccel() = default;
+
+BVHBuildNode* BVHAccel::createLeaf(BVHBuildNode* node, const std::vector<BVHPrimitiveInfo>& primitiveInfo,
+                                   int start, int end, std::vector<int>& orderedPrims)
+{
+    int nPrimitives = end - start;
+    int slots = (nPrimitives + leafPacketWidth - 1) / leafPacketWidth * leafPacketWidth;
+    node->firstPrimOffset = orderedPrimsOffset.fetch_add(slots);
+    node->nPrimitives = nPrimitives;
+    for (int i = 0; i < nPrimitives; ++i) {
+        const BVHPrimitiveInfo& info = primitiveInfo[start + i];
+        node->bounds = Union(node->bounds, info.bounds);
+        orderedPrims[node->firstPrimOffset + i] = info.primitiveNumber;
     }
-    else {
-        Bounds3 centroidBounds;
-        for (int i = 0; i < objects.size(); ++i)
-            centroidBounds =
-                Union(centroidBounds, objects[i]->getBounds().Centroid());
-        int dim = centroidBounds.maxExtent();
-        switch (dim) {
-        case 0:
-            std::sort(objects.begin(), objects.end(), [](auto f1, auto f2) {
-                return f1->getBounds().Centroid().x <
-                       f2->getBounds().Centroid().x;
-            });
-            break;
-        case 1:
-            std::sort(objects.begin(), objects.end(), [](auto f1, auto f2) {
-                return f1->getBounds().Centroid().y <
-                       f2->getBounds().Centroid().y;
-            });
-            break;
-        case 2:
-            std::sort(objects.begin(), objects.end(), [](auto f1, auto f2) {
-                return f1->getBounds().Centroid().z <
-                       f2->getBounds().Centroid().z;
-            });
-            break;
+    return node;
+}
+
+void BVHAccel::computeBounds(const std::vector<BVHPrimitiveInfo>& primitiveInfo, int start, int end,
+                             Bounds3& bounds, Bounds3& centroidBounds) const
+{
+    using BoundsPair = std::pair<Bounds3, Bounds3>;
+    auto chunk = [&](int64_t begin, int64_t end) {
+        BoundsPair result;
+        for (int64_t i = begin; i < end; ++i) {
+            result.first = Union(result.first, primitiveInfo[i].bounds);
+            result.second = Union(result.second, primitiveInfo[i].centroid);
         }
+        return result;
+    };
+    BoundsPair result;
+    if (end - start >= parallelBuildThreshold)
+        result = parallel_reduce(start, end, 1024, BoundsPair(), chunk,
+                                 [](const BoundsPair& a, const BoundsPair& b) {
+                                     return BoundsPair(Union(a.first, b.first), Union(a.second, b.second));
+                                 });
+    else
+        result = chunk(start, end);
+    bounds = result.first;
+    centroidBounds = result.second;
+}
+
+BVHBuildNode* BVHAccel::recursiveBuild(std::vector<BVHPrimitiveInfo>& primitiveInfo, int start, int end,
+                                       std::vector<int>& orderedPrims, int depth)
+{
+    BVHBuildNode* node = &buildNodes[buildNodeCount.fetch_add(1)];
+    int nPrimitives = end - start;
 
-        auto beginning = objects.begin();
-        auto middling = objects.begin() + (objects.size() / 2);
-        auto ending = objects.end();
+    if (nPrimitives == 1)
+        return createLeaf(node, primitiveInfo, start, end, orderedPrims);
 
-        auto leftshapes = std::vector<Object*>(beginning, middling);
-        auto rightshapes = std::vector<Object*>(middling, ending);
+    Bounds3 bounds, centroidBounds;
+    computeBounds(primitiveInfo, start, end, bounds, centroidBounds);
+    int dim = centroidBounds.maxExtent();
 
-        assert(objects.size() == (leftshapes.size() + rightshapes.size()));
+    auto first = primitiveInfo.begin() + start, last = primitiveInfo.begin() + end;
+    int mid = -1;
+    if (splitMethod == SplitMethod::SAH) {
+        // past maxSAHDepth split by count, so degenerate inputs cannot deepen the
+        // tree beyond what the traversal stacks hold
+        if (depth >= maxSAHDepth) {
+            if (nPrimitives <= maxPrimsInNode)
+                return createLeaf(node, primitiveInfo, start, end, orderedPrims);
+        }
+        // all centroids coincide, no split can separate them
+        else if (centroidBounds.pMax[dim] == centroidBounds.pMin[dim]) {
+            if (nPrimitives <= maxPrimsInNode)
+                return createLeaf(node, primitiveInfo, start, end, orderedPrims);
+            mid = (start + end) / 2;
+        }
+        else {
+            int splitBucket = findSAHSplit(primitiveInfo, start, end, bounds, centroidBounds, dim);
+            if (splitBucket < 0 && nPrimitives <= maxPrimsInNode)
+                return createLeaf(node, primitiveInfo, start, end, orderedPrims);
+            // no finite split cost (overflowing bounds): the median split below
+            if (splitBucket >= 0) {
+                auto pmid = std::partition(first, last, [&](const BVHPrimitiveInfo& info) {
+                    return bucketIndex(info.centroid, centroidBounds, dim) <= splitBucket;
+                });
+                mid = pmid - primitiveInfo.begin();
+            }
+        }
+    }
 
-        node->left = recursiveBuild(leftshapes);
-        node->right = recursiveBuild(rightshapes);
+    if (mid <= start || mid >= end) {
+        // split at the median centroid of the longest axis, a partial sort is enough
+        mid = (start + end) / 2;
+        std::nth_element(first, primitiveInfo.begin() + mid, last,
+                         [dim](const BVHPrimitiveInfo& a, const BVHPrimitiveInfo& b) {
+                             return a.centroid[dim] < b.centroid[dim];
+                         });
+    }
 
-        node->bounds = Union(node->left->bounds, node->right->bounds);
-        node->area = node->left->area + node->right->area;
+    node->splitAxis = dim;
+    if (nPrimitives >= parallelBuildThreshold) {
+        // large subtrees are forked, the right half may be stolen by another worker
+        TaskGroup group;
+        group.run([&] { node->right = recursiveBuild(primitiveInfo, mid, end, orderedPrims, depth + 1); });
+        node->left = recursiveBuild(primitiveInfo, start, mid, orderedPrims, depth + 1);
+        group.wait();
+    }
+    else {
+        node->left = recursiveBuild(primitiveInfo, start, mid, orderedPrims, depth + 1);
+        node->right = recursiveBuild(primitiveInfo, mid, end, orderedPrims, depth + 1);
     }
 
+    node->bounds = Union(node->left->bounds, node->right->bounds);
+
     return node;
 }
 
+// Append the subtree rooted at node to nodes in depth-first order, returns its offset.
+int BVHAccel::flattenBVHTree(BVHBuildNode* node)
+{
+    int offset = nodes.size();
+    nodes.emplace_back();
+    nodes[offset].bounds = node->bounds;
+    if (node->nPrimitives > 0) {
+        nodes[offset].primitivesOffset = node->firstPrimOffset;
+        nodes[offset].nPrimitives = node->nPrimitives;
+    }
+    else {
+        nodes[offset].axis = node->splitAxis;
+        nodes[offset].nPrimitives = 0;
+        flattenBVHTree(node->left);
+        int second = flattenBVHTree(node->right);
+        nodes[offset].secondChildOffset = second;
+    }
+    return offset;
+}
+
+int BVHAccel::bucketIndex(const Vector3f& centroid, const Bounds3& centroidBounds, int dim)
+{
+    int b = nBuckets * centroidBounds.Offset(centroid)[dim];
+    return std::min(b, nBuckets - 1);
+}
+
+// Binned SAH: bin the centroids along dim and evaluate the cost of splitting after
+// each bucket boundary. Returns the last bucket of the left child, or -1 if making
+// a leaf of all objects is cheaper (only allowed up to maxPrimsInNode objects).
+int BVHAccel::findSAHSplit(const std::vector<BVHPrimitiveInfo>& primitiveInfo, int start, int end,
+                           const Bounds3& bounds, const Bounds3& centroidBounds, int dim) const
+{
+    struct Bucket
+    {
+        int count = 0;
+        Bounds3 bounds;
+    };
+    Bucket buckets[nBuckets];
+    for (int p = start; p < end; ++p) {
+        int i = bucketIndex(primitiveInfo[p].centroid, centroidBounds, dim);
+        buckets[i].count++;
+        buckets[i].bounds = Union(buckets[i].bounds, primitiveInfo[p].bounds);
+    }
+
+    // sweep from the right to get the suffix areas, then from the left for the costs
+    float rightArea[nBuckets];
+    int rightCount[nBuckets];
+    Bounds3 acc;
+    int count = 0;
+    for (int i = nBuckets - 1; i > 0; --i) {
+        acc = Union(acc, buckets[i].bounds);
+        count += buckets[i].count;
+        rightCount[i] = count;
+        rightArea[i] = count ? acc.SurfaceArea() : 0;
+    }
+
+    float minCost = std::numeric_limits<float>::max();
+    int minBucket = -1;
+    acc = Bounds3();
+    count = 0;
+    for (int i = 0; i < nBuckets - 1; ++i) {
+        acc = Union(acc, buckets[i].bounds);
+        count += buckets[i].count;
+        if (count == 0 || rightCount[i + 1] == 0)
+            continue;
+        // in packet tests, the unit of leafCost below
+        float cost = packetCount(count) * acc.SurfaceArea() + packetCount(rightCount[i + 1]) * rightArea[i + 1];
+        if (cost < minCost) {
+            minCost = cost;
+            minBucket = i;
+        }
+    }
+
+    float nodeArea = bounds.SurfaceArea();
+    float splitCost = traversalCost + (nodeArea > 0 ? minCost / nodeArea : 0);
+    float leafCost = packetCount(end - start);
+    if (end - start <= maxPrimsInNode && (minBucket < 0 || leafCost <= splitCost))
+        return -1;
+    return minBucket;
+}
+
+// Expected cost of a random ray hitting the root, in units of one primitive test.
+float BVHAccel::SAHCost() const
+{
+    if (nodes.empty())
+        return 0;
+    float rootArea = nodes[0].bounds.SurfaceArea();
+    if (rootArea <= 0)
+        return 0;
+
+    float cost = 0;
+    for (const LinearBVHNode& node : nodes) {
+        float p = node.bounds.SurfaceArea() / rootArea;
+        if (node.nPrimitives > 0)
+            cost += p * packetCount(node.nPrimitives);
+        else
+            cost += p * traversalCost;
+    }
+    return cost;
+}
+
+// Intersect the primitives [offset, offset + count) of a leaf, keeping the closest hit in isect.
+inline void BVHAccel::intersectLeaf(int offset, int count, const Ray& ray, Intersection& isect) const
+{
+    if (mesh) {
+        // the packet kernel culls the triangles in float, the hit lanes are confirmed
+        // nearest first by the same double precision test the shadow rays use; only
+        // the first confirmed lane fills the Intersection
+        float tMax = std::min<double>(isect.distance, std::numeric_limits<float>::max());
+        for (int p = offset; p < offset + count; p += TrianglePacket::width) {
+            float t[TrianglePacket::width];
+            int mask = packets[p / TrianglePacket::width].intersect(ray, tMax, t);
+            for (int lane; (lane = TrianglePacket::nearest(mask, t)) >= 0; mask &= ~(1 << lane)) {
+                Intersection hit;
+                if (mesh->intersect(faces[p + lane], ray, hit) && hit.distance < isect.distance) {
+                    hit.obj = owner;
+                    isect = hit;
+                    tMax = t[lane];
+                    break;
+                }
+            }
+        }
+        return;
+    }
+    for (int i = 0; i < count; ++i) {
+        Intersection hit = primitives[offset + i]->getIntersection(ray);
+        if (hit.happened && hit.distance < isect.distance)
+            isect = hit;
+    }
+}
+
+inline bool BVHAccel::intersectLeafP(int offset, int count, const Ray& ray) const
+{
+    if (mesh) {
+        float tMax = std::min<double>(ray.t_max, std::numeric_limits<float>::max());
+        for (int p = offset; p < offset + count; p += TrianglePacket::width) {
+            float t[TrianglePacket::width];
+            int mask = packets[p / TrianglePacket::width].intersect(ray, tMax, t);
+            // confirm in double like intersectLeaf, so both queries agree on every hit
+            for (int lane = 0; lane < TrianglePacket::width; ++lane)
+                if ((mask & (1 << lane)) && mesh->intersectP(faces[p + lane], ray))
+                    return true;
+        }
+        return false;
+    }
+    for (int i = 0; i < count; ++i)
+        if (primitives[offset + i]->intersectP(ray))
+            return true;
+    return false;
+}
+
 Intersection BVHAccel::Intersect(const Ray& ray) const
 {
+    if (!wideNodes.empty())
+        return intersectWide(ray);
+
     Intersection isect;
-    if (!root)
+    if (nodes.empty())
         return isect;
-    isect = BVHAccel::getIntersection(root, ray);
+
+    const Vector3f& invDir = ray.direction_inv;
+    const std::array<int, 3> dirIsNeg = {int(ray.direction.x>0),int(ray.direction.y>0),int(ray.direction.z>0)};
+
+    // Traverse the BVH to find intersection, nearer child first; boxes behind
+    // the closest hit found so far are culled
+    int toVisitOffset = 0, currentNodeIndex = 0;
+    int nodesToVisit[maxDepth];
+    while (true) {
+        const LinearBVHNode* node = &nodes[currentNodeIndex];
+        if (node->bounds.IntersectP(ray, invDir, dirIsNeg, isect.distance)) {
+            if (node->nPrimitives > 0) {
+                intersectLeaf(node->primitivesOffset, node->nPrimitives, ray, isect);
+                if (toVisitOffset == 0)
+                    break;
+                currentNodeIndex = nodesToVisit[--toVisitOffset];
+            }
+            else {
+                // dirIsNeg holds 1 for a positive direction: then the first child is nearer
+                if (dirIsNeg[node->axis]) {
+                    nodesToVisit[toVisitOffset++] = node->secondChildOffset;
+                    currentNodeIndex = currentNodeIndex + 1;
+                }
+                else {
+                    nodesToVisit[toVisitOffset++] = currentNodeIndex + 1;
+                    currentNodeIndex = node->secondChildOffset;
+                }
+            }
+        }
+        else {
+            if (toVisitOffset == 0)
+                break;
+            currentNodeIndex = nodesToVisit[--toVisitOffset];
+        }
+    }
     return isect;
 }
 
-Intersection BVHAccel::getIntersection(BVHBuildNode* node, const Ray& ray) const
+bool BVHAccel::IntersectP(const Ray& ray) const
 {
-    // Traverse the BVH to find intersection
-    const std::array<int, 3>& dirIsNeg = {int(ray.direction.x>0),int(ray.direction.y>0),int(ray.direction.z>0)};
-    if(!node->bounds.IntersectP(ray, ray.direction_inv, dirIsNeg)){
-        return Intersection();
+    if (!wideNodes.empty())
+        return intersectPWide(ray);
+    if (nodes.empty())
+        return false;
+
+    const Vector3f& invDir = ray.direction_inv;
+    const std::array<int, 3> dirIsNeg = {int(ray.direction.x>0),int(ray.direction.y>0),int(ray.direction.z>0)};
+
+    // visiting order does not matter for an occlusion query, any hit ends it
+    int toVisitOffset = 0, currentNodeIndex = 0;
+    int nodesToVisit[maxDepth];
+    while (true) {
+        const LinearBVHNode* node = &nodes[currentNodeIndex];
+        if (node->bounds.IntersectP(ray, invDir, dirIsNeg, ray.t_max)) {
+            if (node->nPrimitives > 0) {
+                if (intersectLeafP(node->primitivesOffset, node->nPrimitives, ray))
+                    return true;
+                if (toVisitOffset == 0)
+                    break;
+                currentNodeIndex = nodesToVisit[--toVisitOffset];
+            }
+            else {
+                nodesToVisit[toVisitOffset++] = node->secondChildOffset;
+                currentNodeIndex = currentNodeIndex + 1;
+            }
+        }
+        else {
+            if (toVisitOffset == 0)
+                break;
+            currentNodeIndex = nodesToVisit[--toVisitOffset];
+        }
     }
-    if(!(node->object == nullptr)){
-        return node->object->getIntersection(ray);
+    return false;
+}
+
+void BVHAccel::setWide(bool wide)
+{
+    if (!wide)
+        wideNodes.clear();
+    else if (wideNodes.empty() && !nodes.empty())
+        collapseToWide(0);
+}
+
+// Turn node and its descendants into 4-wide nodes: starting from node's two
+// children, the interior child with the largest surface area is repeatedly
+// replaced by its own children until four lanes are filled.
+// Returns the index of the new wide node.
+int BVHAccel::collapseToWide(int nodeIndex)
+{
+    // in the flattened tree the first child of node i is i + 1
+    auto isLeaf = [this](int i) { return nodes[i].nPrimitives > 0; };
+    auto area = [this](int i) { return nodes[i].bounds.SurfaceArea(); };
+    int children[4];
+    int n = 0;
+    if (isLeaf(nodeIndex)) {
+        children[n++] = nodeIndex;
+    }
+    else {
+        children[n++] = nodeIndex + 1;
+        children[n++] = nodes[nodeIndex].secondChildOffset;
+    }
+    while (n < 4) {
+        int best = -1;
+        double bestArea = -1;
+        for (int i = 0; i < n; ++i) {
+            if (!isLeaf(children[i]) && area(children[i]) > bestArea) {
+                best = i;
+                bestArea = area(children[i]);
+            }
+        }
+        if (best < 0)
+            break;
+        int opened = children[best];
+        children[best] = opened + 1;
+        children[n++] = nodes[opened].secondChildOffset;
     }
 
-    Intersection hit1 = node->left == nullptr ? Intersection() : getIntersection(node->left, ray);
-    Intersection hit2 = node->right == nullptr ? Intersection() : getIntersection(node->right, ray);
+    int offset = wideNodes.size();
+    wideNodes.emplace_back();
+    for (int i = 0; i < 4; ++i) {
+        int child = -1, count = 0;
+        Bounds3 b;  // empty box for unused lanes: min = +max, max = lowest
+        if (i < n) {
+            b = nodes[children[i]].bounds;
+            if (isLeaf(children[i])) {
+                child = nodes[children[i]].primitivesOffset;
+                count = nodes[children[i]].nPrimitives;
+            }
+            else {
+                child = collapseToWide(children[i]);
+            }
+        }
+        // recursion may have reallocated wideNodes, index again
+        BVH4Node& wide = wideNodes[offset];
+        wide.bminX[i] = b.pMin.x; wide.bminY[i] = b.pMin.y; wide.bminZ[i] = b.pMin.z;
+        wide.bmaxX[i] = b.pMax.x; wide.bmaxY[i] = b.pMax.y; wide.bmaxZ[i] = b.pMax.z;
+        wide.child[i] = child;
+        wide.count[i] = count;
+    }
+    return offset;
+}
+
+namespace
+{
+    // per-ray data for the 4-wide slab test: the near/far planes of every axis
+    // are picked by the sign of the direction, so empty lanes (min > max) always miss
+    struct WideRay
+    {
+        float org[3], inv[3];
+        bool dirPos[3];
 
-    return hit1.distance < hit2.distance ? hit1 : hit2;
+        explicit WideRay(const Ray& ray)
+        {
+            for (int a = 0; a < 3; ++a) {
+                org[a] = ray.origin[a];
+                inv[a] = ray.direction_inv[a];
+                dirPos[a] = ray.direction[a] > 0;
+            }
+        }
+    };
+
+    // test the ray against the four child boxes of node, returns a bit mask of
+    // the lanes entered before tMax and stores their entry distances in tNear
+    inline int intersectBox4(const BVH4Node& node, const WideRay& r, float tMax, float tNear[4])
+    {
+        const float* nearX = r.dirPos[0] ? node.bminX : node.bmaxX;
+        const float* farX  = r.dirPos[0] ? node.bmaxX : node.bminX;
+        const float* nearY = r.dirPos[1] ? node.bminY : node.bmaxY;
+        const float* farY  = r.dirPos[1] ? node.bmaxY : node.bminY;
+        const float* nearZ = r.dirPos[2] ? node.bminZ : node.bmaxZ;
+        const float* farZ  = r.dirPos[2] ? node.bmaxZ : node.bminZ;
+#ifdef BVH_USE_SSE
+        const __m128 ox = _mm_set1_ps(r.org[0]), oy = _mm_set1_ps(r.org[1]), oz = _mm_set1_ps(r.org[2]);
+        const __m128 ix = _mm_set1_ps(r.inv[0]), iy = _mm_set1_ps(r.inv[1]), iz = _mm_set1_ps(r.inv[2]);
+        __m128 tEnter = _mm_max_ps(_mm_max_ps(_mm_mul_ps(_mm_sub_ps(_mm_load_ps(nearX), ox), ix),
+                                              _mm_mul_ps(_mm_sub_ps(_mm_load_ps(nearY), oy), iy)),
+                                   _mm_mul_ps(_mm_sub_ps(_mm_load_ps(nearZ), oz), iz));
+        __m128 tExit = _mm_min_ps(_mm_min_ps(_mm_mul_ps(_mm_sub_ps(_mm_load_ps(farX), ox), ix),
+                                             _mm_mul_ps(_mm_sub_ps(_mm_load_ps(farY), oy), iy)),
+                                  _mm_mul_ps(_mm_sub_ps(_mm_load_ps(farZ), oz), iz));
+        __m128 hit = _mm_and_ps(_mm_and_ps(_mm_cmple_ps(tEnter, tExit),
+                                           _mm_cmpge_ps(tExit, _mm_setzero_ps())),
+                                _mm_cmplt_ps(tEnter, _mm_set1_ps(tMax)));
+        _mm_storeu_ps(tNear, tEnter);
+        return _mm_movemask_ps(hit);
+#else
+        int mask = 0;
+        for (int i = 0; i < 4; ++i) {
+            float tEnter = std::max(std::max((nearX[i] - r.org[0]) * r.inv[0], (nearY[i] - r.org[1]) * r.inv[1]),
+                                    (nearZ[i] - r.org[2]) * r.inv[2]);
+            float tExit = std::min(std::min((farX[i] - r.org[0]) * r.inv[0], (farY[i] - r.org[1]) * r.inv[1]),
+                                   (farZ[i] - r.org[2]) * r.inv[2]);
+            tNear[i] = tEnter;
+            if (tEnter <= tExit && tExit >= 0 && tEnter < tMax)
+                mask |= 1 << i;
+        }
+        return mask;
+#endif
+    }
+
+    struct WideStackEntry
+    {
+        int child, count;
+        float tNear;
+    };
 }
 
+Intersection BVHAccel::intersectWide(const Ray& ray) const
+{
+    Intersection isect;
+    WideRay r(ray);
 
-void BVHAccel::getSample(BVHBuildNode* node, float p, Intersection &pos, float &pdf){
-    if(node->left == nullptr || node->right == nullptr){
-        node->object->Sample(pos, pdf);
-        pdf *= node->area;
-        return;
+    // a wide node adds at most three entries net
+    WideStackEntry stack[4 * maxDepth];
+    int stackSize = 0;
+    stack[stackSize++] = {0, 0, -std::numeric_limits<float>::max()};
+    while (stackSize > 0) {
+        WideStackEntry entry = stack[--stackSize];
+        if (entry.tNear >= isect.distance)
+            continue;
+        if (entry.count > 0) {
+            intersectLeaf(entry.child, entry.count, ray, isect);
+            continue;
+        }
+
+        const BVH4Node& node = wideNodes[entry.child];
+        float tNear[4];
+        int mask = intersectBox4(node, r, std::min<double>(isect.distance, std::numeric_limits<float>::max()), tNear);
+
+        // push the hit lanes far to near, so the nearest one is popped first
+        int lanes[4], nHit = 0;
+        for (int i = 0; i < 4; ++i) {
+            if (!(mask & (1 << i)))
+                continue;
+            int j = nHit++;
+            while (j > 0 && tNear[lanes[j - 1]] < tNear[i]) {
+                lanes[j] = lanes[j - 1];
+                --j;
+            }
+            lanes[j] = i;
+        }
+        for (int k = 0; k < nHit; ++k)
+            stack[stackSize++] = {node.child[lanes[k]], node.count[lanes[k]], tNear[lanes[k]]};
     }
-    if(p < node->left->area) getSample(node->left, p, pos, pdf);
-    else getSample(node->right, p - node->left->area, pos, pdf);
+    return isect;
 }
 
-void BVHAccel::Sample(Intersection &pos, float &pdf){
-    // why we need to take the sqrt here?
-    float p = std::sqrt(get_random_float()) * root->area;
-    // float p = get_random_float() * root->area;
-    getSample(root, p, pos, pdf);
-    pdf /= root->area;
-}
\ No newline at end of file
+bool BVHAccel::intersectPWide(const Ray& ray) const
+{
+    WideRay r(ray);
+    float tMax = std::min<double>(ray.t_max, std::numeric_limits<float>::max());
+
+    int stack[4 * maxDepth];
+    int stackSize = 0;
+    stack[stackSize++] = 0;
+    while (stackSize > 0) {
+        const BVH4Node& node = wideNodes[stack[--stackSize]];
+        float tNear[4];
+        int mask = intersectBox4(node, r, tMax, tNear);
+        for (int i = 0; i < 4; ++i) {
+            if (!(mask & (1 << i)))
+                continue;
+            if (node.count[i] == 0) {
+                stack[stackSize++] = node.child[i];
+                continue;
+            }
+            if (intersectLeafP(node.child[i], node.count[i], ray))
+                return true;
+        }
+    }
+    return false;
+}
@@ -8,10 +8,64 @@
 #include "Bounds3.hpp"
 #include "Intersection.hpp"
 #include "Vector.hpp"
+#include "TaskScheduler.hpp"
+#include "TrianglePacket.hpp"
+#include "TriangleMesh.hpp"
 
-struct BVHBuildNode;
-// BVHAccel Forward Declarations
-struct BVHPrimitiveInfo;
+// BVHAccel Local Declarations
+// Build-time copy of a primitive's bounds, so that splitting never calls back
+// into the (virtual) Object interface
+struct BVHPrimitiveInfo {
+    BVHPrimitiveInfo() {}
+    BVHPrimitiveInfo(int primitiveNumber, const Bounds3& bounds)
+        : primitiveNumber(primitiveNumber), bounds(bounds),
+          centroid(0.5f * bounds.pMin + 0.5f * bounds.pMax) {}
+    int primitiveNumber;
+    Bounds3 bounds;
+    Vector3f centroid;
+};
+
+struct BVHBuildNode {
+    Bounds3 bounds;
+    BVHBuildNode *left;
+    BVHBuildNode *right;
+
+public:
+    // leaves own primitives[firstPrimOffset, firstPrimOffset + nPrimitives)
+    int splitAxis=0, firstPrimOffset=0, nPrimitives=0;
+    // BVHBuildNode Public Methods
+    BVHBuildNode(){
+        bounds = Bounds3();
+        left = nullptr;right = nullptr;
+    }
+};
+
+// Compact node of the flattened tree, stored in depth-first order: the first
+// child of an interior node directly follows it, the second one sits at
+// secondChildOffset.
+struct alignas(32) LinearBVHNode {
+    Bounds3 bounds;
+    union {
+        int primitivesOffset;   // leaf
+        int secondChildOffset;  // interior
+    };
+    uint16_t nPrimitives;       // 0 -> interior node
+    uint8_t axis;               // interior node: split axis
+    uint8_t pad[1];
+};
+static_assert(sizeof(LinearBVHNode) == 32, "LinearBVHNode should fill half a cache line");
+
+// Node of the 4-wide tree collapsed from the binary one. The child boxes are
+// stored as structure of arrays so one SSE kernel tests all four at once.
+// child[i] is a wide node index if count[i] == 0, else the primitivesOffset of
+// a leaf with count[i] primitives; unused lanes have child[i] == -1 and an
+// empty box.
+struct alignas(64) BVH4Node {
+    float bminX[4], bminY[4], bminZ[4];
+    float bmaxX[4], bmaxY[4], bmaxZ[4];
+    int child[4];
+    uint16_t count[4];
+};
 
 // BVHAccel Declarations
 inline int leafNodes, totalLeafNodes, totalPrimitives, interiorNodes;
@@ -22,40 +76,96 @@ public:
     enum class SplitMethod { NAIVE, SAH };
 
     // BVHAccel Public Methods
+    // BVH over objects, the leaves call into the Object interface
     BVHAccel(std::vector<Object*> p, int maxPrimsInNode = 1, SplitMethod splitMethod = SplitMethod::NAIVE);
+    // BVH over the faces of an indexed mesh. Every leaf starts at a multiple of
+    // TrianglePacket::width in faces and is intersected one packet at a time, so
+    // the SAH charges one primitive test per packet. Hits report owner as obj.
+    BVHAccel(const TriangleMesh* mesh, Object* owner, SplitMethod splitMethod = SplitMethod::SAH);
+    // mesh BVH restored from a mesh cache (see MeshCache), without a build tree
+    BVHAccel(const TriangleMesh* mesh, Object* owner, SplitMethod splitMethod,
+             std::vector<LinearBVHNode> nodes, std::vector<uint32_t> faces);
     Bounds3 WorldBound() const;
     ~BVHAccel();
 
     Intersection Intersect(const Ray &ray) const;
-    Intersection getIntersection(BVHBuildNode* node, const Ray& ray)const;
+    // any-hit query in (0, ray.t_max), stops at the first primitive hit
     bool IntersectP(const Ray &ray) const;
-    BVHBuildNode* root;
+
+    // switch traversal between the binary tree and the collapsed 4-wide tree
+    void setWide(bool wide);
+    // pointer-linked build tree, its nodes live in buildNodes; both are released
+    // once the tree is flattened
+    BVHBuildNode* root = nullptr;
+    std::vector<BVHBuildNode> buildNodes;
+    std::atomic<int> buildNodeCount{0};
+    // the tree used for traversal
+    std::vector<LinearBVHNode> nodes;
+    // 4-wide version of the same tree, used instead of nodes when not empty
+    std::vector<BVH4Node> wideNodes;
+    // SoA copy of the leaf triangles of a mesh BVH, packets[i] holds faces[4i, 4i + 4)
+    std::vector<TrianglePacket> packets;
+
+    // expected cost of a ray traversing the tree, relative to one primitive test
+    float SAHCost() const;
 
     // BVHAccel Private Methods
-    BVHBuildNode* recursiveBuild(std::vector<Object*>objects);
+    // builds and flattens the tree, returns the primitive numbers in leaf order
+    // (-1 for padding slots)
+    std::vector<int> build(std::vector<BVHPrimitiveInfo>& primitiveInfo);
+    // builds the subtree over primitiveInfo[start, end), reordering that range in place
+    BVHBuildNode* recursiveBuild(std::vector<BVHPrimitiveInfo>& primitiveInfo, int start, int end,
+                                 std::vector<int>& orderedPrims, int depth);
+    BVHBuildNode* createLeaf(BVHBuildNode* node, const std::vector<BVHPrimitiveInfo>& primitiveInfo,
+                             int start, int end, std::vector<int>& orderedPrims);
+    void computeBounds(const std::vector<BVHPrimitiveInfo>& primitiveInfo, int start, int end,
+                       Bounds3& bounds, Bounds3& centroidBounds) const;
+    int findSAHSplit(const std::vector<BVHPrimitiveInfo>& primitiveInfo, int start, int end,
+                     const Bounds3& bounds, const Bounds3& centroidBounds, int dim) const;
+    // primitive tests needed for n primitives of a leaf, one per packet
+    int packetCount(int n) const { return (n + leafPacketWidth - 1) / leafPacketWidth; }
+    static int bucketIndex(const Vector3f& centroid, const Bounds3& centroidBounds, int dim);
+    int flattenBVHTree(BVHBuildNode* node);
+    int collapseToWide(int nodeIndex);
+    // copy the leaf triangles of a mesh BVH into packets
+    void fillPackets();
+    Intersection intersectWide(const Ray& ray) const;
+    bool intersectPWide(const Ray& ray) const;
+    inline void intersectLeaf(int offset, int count, const Ray& ray, Intersection& isect) const;
+    inline bool intersectLeafP(int offset, int count, const Ray& ray) const;
+
+    // SAH parameters: number of centroid bins and the cost of one node visit
+    // relative to one primitive intersection
+    static constexpr int nBuckets = 16;
+    static constexpr float traversalCost = 0.125f;
+    // nodes with at least this many primitives build their children as parallel
+    // tasks and compute their bounds with a parallel reduction
+    static constexpr int parallelBuildThreshold = 4096;
+    // SAH splits stop at maxSAHDepth, below it the median splits add at most
+    // log2(2^31) levels; the traversal stacks are sized for maxDepth
+    static constexpr int maxSAHDepth = 32;
+    static constexpr int maxDepth = 64;
 
     // BVHAccel Private Data
     const int maxPrimsInNode;
     const SplitMethod splitMethod;
+    const int leafPacketWidth;
+    // object BVH: the objects in leaf order
     std::vector<Object*> primitives;
-
-    void getSample(BVHBuildNode* node, float p, Intersection &pos, float &pdf);
-    void Sample(Intersection &pos, float &pdf);
+    // mesh BVH: the face indices in leaf order, padded to full packets
+    const TriangleMesh* mesh = nullptr;
+    Object* owner = nullptr;
+    std::vector<uint32_t> faces;
+    // next free slot of the ordered primitive array, leaves are created concurrently
+    std::atomic<int> orderedPrimsOffset{0};
 };
 
-struct BVHBuildNode {
-    Bounds3 bounds;
-    BVHBuildNode *left;
-    BVHBuildNode *right;
-    Object* object;
-    float area;
-
-public:
-    int splitAxis=0, firstPrimOffset=0, nPrimitives=0;
-    // BVHBuildNode Public Methods
-    BVHBuildNode(){
-        bounds = Bounds3();
-        left = nullptr;right = nullptr;
-        object = nullptr;
-    }
+// BVH construction settings, chosen at Scene::buildBVH() time
+struct BVHBuildOptions {
+    BVHAccel::SplitMethod splitMethod = BVHAccel::SplitMethod::SAH;
+    // traverse 4-wide nodes with SIMD box tests instead of the binary tree
+    bool wide = false;
+    // build one scene BVH over the triangles of all meshes instead of nesting
+    // the per-mesh BVHs below a BVH over the objects; instances stay nested
+    bool flatten = false;
 };
@@ -80,16 +80,18 @@ class Bounds3
     }
 
     inline bool IntersectP(const Ray& ray, const Vector3f& invDir,
-                           const std::array<int, 3>& dirisNeg) const;
+                           const std::array<int, 3>& dirisNeg,
+                           double tMax = std::numeric_limits<double>::max()) const;
 };
 
 
 
 inline bool Bounds3::IntersectP(const Ray& ray, const Vector3f& invDir,
-                                const std::array<int, 3>& dirIsNeg) const
+                                const std::array<int, 3>& dirIsNeg, double tMax) const
 {
     // invDir: ray direction(x,y,z), invDir=(1.0/x,1.0/y,1.0/z), use this because Multiply is faster that Division
     // dirIsNeg: ray direction(x,y,z), dirIsNeg=[int(x>0),int(y>0),int(z>0)], use this to simplify your logic
+    // tMax: boxes entered beyond tMax (e.g. the closest hit so far) are reported as missed
     // test if ray bound intersects
     double tMinx, tMaxx, tMiny, tMaxy, tMinz, tMaxz;
     double t1 = 0;
@@ -127,7 +129,7 @@ inline bool Bounds3::IntersectP(const Ray& ray, const Vector3f& invDir,
     double tEnter = tMaxxy>tMinz?tMaxxy:tMinz;
     double tMinxy = tMaxx<tMaxy?tMaxx:tMaxy;
     double tExit = tMinxy<tMaxz?tMinxy:tMaxz;
-    return (tEnter <= tExit && tExit >= 0);
+    return (tEnter <= tExit && tExit >= 0 && tEnter < tMax);
 }
 
 inline Bounds3 Union(const Bounds3& b1, const Bounds3& b2)
@@ -0,0 +1,85 @@
+#pragma once
+
+#include "Object.hpp"
+#include "Triangle.hpp"
+#include "Transform.hpp"
+
+// A placement of a shared Mesh in the scene. The mesh (triangles and BVH) is the
+// bottom-level structure and is stored once no matter how many instances refer
+// to it; the instance only keeps its transform and an optional material that
+// replaces the mesh material. The scene BVH is the top level: rays reaching an
+// instance are transformed into mesh space and traced through the mesh BVH.
+class Instance : public Object
+{
+public:
+    Instance(Mesh* mesh, const Transform& toWorld, Material* mt = nullptr)
+        : mesh(mesh), toWorld(toWorld), toLocal(toWorld.inverse()), m(mt)
+    {
+        bounding_box = toWorld.bounds(mesh->getBounds());
+        // faces by world space area: a scaling transform changes their relative sizes
+        std::vector<float> faceAreas(mesh->geometry.numFaces());
+        for (size_t f = 0; f < faceAreas.size(); ++f) {
+            Vector3f e1, e2;
+            mesh->geometry.edges(f, e1, e2);
+            faceAreas[f] = crossProduct(toWorld.vector(e1), toWorld.vector(e2)).norm() * 0.5f;
+        }
+        faceTable.build(faceAreas);
+        area = faceTable.total;
+        // only emitters are sampled, the others do not need the table
+        if (!hasEmit())
+            faceTable = AliasTable();
+    }
+
+    Intersection getIntersection(Ray ray)
+    {
+        // the direction is not renormalized, so hit distances stay valid in world space
+        Ray local(toLocal.point(ray.origin), toLocal.vector(ray.direction));
+        local.t_max = ray.t_max;
+        Intersection isect = mesh->getIntersection(local);
+        if (!isect.happened)
+            return isect;
+        isect.coords = toWorld.point(isect.coords);
+        isect.normal = normalize(toWorld.normal(isect.normal));
+        isect.obj = this;
+        if (m)
+            isect.m = m;
+        return isect;
+    }
+
+    bool intersectP(const Ray& ray)
+    {
+        Ray local(toLocal.point(ray.origin), toLocal.vector(ray.direction));
+        local.t_max = ray.t_max;
+        return mesh->intersectP(local);
+    }
+
+    Bounds3 getBounds() { return bounding_box; }
+
+    void Sample(Intersection &pos, float &pdf, const Vector2f &uFace, const Vector2f &uPoint)
+    {
+        // pick a face by its world space area; an affine map keeps a uniform point
+        // on a triangle uniform, so the point is uniform in world space area
+        size_t face = faceTable.sample(uFace.x, uFace.y);
+        mesh->geometry.sampleFace(face, uPoint, pos);
+        pos.coords = toWorld.point(pos.coords);
+        pos.normal = normalize(toWorld.normal(pos.normal));
+        pos.emit = material()->getEmission();
+        pdf = 1.0f / area;
+    }
+
+    float getArea() { return area; }
+    bool hasEmit() { return material()->hasEmission(); }
+
+    // shared meshes are built once, however many instances ask for it
+    void buildBVH(const BVHBuildOptions& options) override { mesh->buildBVH(options); }
+
+    Material* material() const { return m ? m : mesh->m; }
+
+    Mesh* mesh;
+    Transform toWorld, toLocal;
+    Material* m;
+    Bounds3 bounding_box;
+    // faces of the mesh by world space area, for sampling emitting instances
+    AliasTable faceTable;
+    float area;
+};
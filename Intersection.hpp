@@ -1,4 +1,5 @@
 #pragma once
+#include <cstdint>
 #include "Vector.hpp"
 #include "Material.hpp"
 class Object;
@@ -13,6 +14,7 @@ struct Intersection
         distance= std::numeric_limits<double>::max();
         obj =nullptr;
         m=nullptr;
+        face=-1;
     }
     bool happened;
     Vector3f coords;
@@ -22,4 +24,6 @@ struct Intersection
     double distance;
     Object* obj;
     Material* m;
+    // face of the mesh that was hit, -1 for other objects
+    int64_t face;
 };
@@ -0,0 +1,331 @@
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include "LightBVH.hpp"
+#include "Triangle.hpp"
+
+namespace
+{
+    float safeAcos(float x) { return std::acos(std::clamp(x, -1.0f, 1.0f)); }
+    float safeSqrt(float x) { return std::sqrt(std::max(x, 0.0f)); }
+
+    Vector3f centroid(const Bounds3& b) { return 0.5f * b.pMin + 0.5f * b.pMax; }
+
+    // cos(max(0, a - b)) and sin(max(0, a - b)) from the sines and cosines of a and b
+    float cosSubClamped(float sinA, float cosA, float sinB, float cosB)
+    {
+        return cosA > cosB ? 1 : cosA * cosB + sinA * sinB;
+    }
+    float sinSubClamped(float sinA, float cosA, float sinB, float cosB)
+    {
+        return cosA > cosB ? 0 : sinA * cosB - cosA * sinB;
+    }
+
+    // v rotated by theta around the unit vector axis (Rodrigues)
+    Vector3f rotate(const Vector3f& v, const Vector3f& axis, float theta)
+    {
+        float c = std::cos(theta), s = std::sin(theta);
+        return v * c + crossProduct(axis, v) * s + axis * (dotProduct(axis, v) * (1 - c));
+    }
+
+    // surface area orientation heuristic of a group of lights, split along dim
+    // of the node bounds (pbrt-v4 LightBounds cost)
+    float evaluateCost(const LightBounds& b, const Bounds3& nodeBounds, int dim)
+    {
+        if (b.normals.empty)
+            return 0;
+        float theta_o = safeAcos(b.normals.cosTheta), theta_e = safeAcos(b.cosTheta_e);
+        float theta_w = std::min(theta_o + theta_e, float(M_PI));
+        float sinTheta_o = safeSqrt(1 - b.normals.cosTheta * b.normals.cosTheta);
+        float M_omega = 2 * M_PI * (1 - b.normals.cosTheta) +
+                        M_PI / 2 * (2 * theta_w * sinTheta_o - std::cos(theta_o - 2 * theta_w) -
+                                    2 * theta_o * sinTheta_o + b.normals.cosTheta);
+        Vector3f d = nodeBounds.Diagonal();
+        float Kr = std::max({d.x, d.y, d.z}) / std::max(float(d[dim]), 1e-6f);
+        return b.power * M_omega * Kr * b.bounds.SurfaceArea();
+    }
+}
+
+DirectionCone Union(const DirectionCone& a, const DirectionCone& b)
+{
+    if (a.empty)
+        return b;
+    if (b.empty)
+        return a;
+    // a or b already holds the other one
+    float theta_a = safeAcos(a.cosTheta), theta_b = safeAcos(b.cosTheta);
+    float theta_d = safeAcos(dotProduct(a.w, b.w));
+    if (std::min(theta_d + theta_b, float(M_PI)) <= theta_a)
+        return a;
+    if (std::min(theta_d + theta_a, float(M_PI)) <= theta_b)
+        return b;
+
+    // smallest cone holding both: rotate a.w towards b.w
+    float theta_o = (theta_a + theta_d + theta_b) / 2;
+    if (theta_o >= M_PI)
+        return DirectionCone::entireSphere();
+    Vector3f wr = crossProduct(a.w, b.w);
+    if (dotProduct(wr, wr) == 0)
+        return DirectionCone::entireSphere();
+    return DirectionCone(rotate(a.w, normalize(wr), theta_o - theta_a), std::cos(theta_o));
+}
+
+LightBounds Union(const LightBounds& a, const LightBounds& b)
+{
+    if (a.normals.empty)
+        return b;
+    if (b.normals.empty)
+        return a;
+    LightBounds u;
+    u.bounds = Union(a.bounds, b.bounds);
+    u.normals = Union(a.normals, b.normals);
+    u.cosTheta_e = std::min(a.cosTheta_e, b.cosTheta_e);
+    u.power = a.power + b.power;
+    return u;
+}
+
+LightBVH::Node::Node(const LightBounds& b, uint32_t childOrLight, bool leaf)
+    : center(centroid(b.bounds)), w(b.normals.w), cosTheta_o(b.normals.cosTheta), cosTheta_e(b.cosTheta_e),
+      power(b.power), childOrLight(childOrLight), leaf(leaf)
+{
+    Vector3f diagonal = b.bounds.Diagonal();
+    radius = 0.5f * std::sqrt(dotProduct(diagonal, diagonal));
+    sinTheta_o = safeSqrt(1 - cosTheta_o * cosTheta_o);
+}
+
+float LightBVH::Node::importance(const Vector3f& p, const Vector3f& n) const
+{
+    Vector3f d = p - center;
+    float d2 = dotProduct(d, d);
+    // inside the bounding sphere every direction is possible
+    if (d2 <= radius * radius)
+        return power / std::max(radius * radius, 1e-12f);
+
+    float invDistance = 1 / std::sqrt(d2);
+    Vector3f wi = d * invDistance;
+    float cosTheta_w = dotProduct(w, wi);
+    float sinTheta_w = safeSqrt(1 - cosTheta_w * cosTheta_w);
+    // half angle of the cone from p that holds the bounds
+    float sinTheta_b = radius * invDistance;
+    float cosTheta_b = safeSqrt(1 - sinTheta_b * sinTheta_b);
+
+    // smallest angle between p and the emitting directions of any light in the bounds
+    float cosTheta_x = cosSubClamped(sinTheta_w, cosTheta_w, sinTheta_o, cosTheta_o);
+    float sinTheta_x = sinSubClamped(sinTheta_w, cosTheta_w, sinTheta_o, cosTheta_o);
+    float cosTheta_p = cosSubClamped(sinTheta_x, cosTheta_x, sinTheta_b, cosTheta_b);
+    if (cosTheta_p <= cosTheta_e)
+        return 0;
+    float importance = power * cosTheta_p / d2;
+
+    // surfaces only reflect light arriving from the side of their normal
+    if (dotProduct(n, n) > 0) {
+        float cosTheta_i = -dotProduct(wi, n);
+        float sinTheta_i = safeSqrt(1 - cosTheta_i * cosTheta_i);
+        importance *= std::max(cosSubClamped(sinTheta_i, cosTheta_i, sinTheta_b, cosTheta_b), 0.0f);
+    }
+    return std::max(importance, 0.0f);
+}
+
+void LightBVH::build(const std::vector<Object*>& objects)
+{
+    lights.clear();
+    nodes.clear();
+    bitTrails.clear();
+    objectLights.clear();
+
+    std::vector<BuildLight> items;
+    for (auto object : objects) {
+        if (auto mesh = dynamic_cast<Mesh*>(object)) {
+            const TriangleMesh& g = mesh->geometry;
+            std::vector<int32_t>* faceLights = nullptr;
+            for (size_t f = 0; f < g.numFaces(); ++f) {
+                LightBounds b;
+                b.power = luminance(g.material(f)->getEmission()) * g.faceArea(f);
+                if (!(b.power > 0))
+                    continue;
+                b.bounds = g.faceBounds(f);
+                b.normals = DirectionCone(g.faceNormal(f), 1);
+                if (!faceLights) {
+                    faceLights = &objectLights[object];
+                    faceLights->assign(g.numFaces(), -1);
+                }
+                (*faceLights)[f] = lights.size();
+                items.push_back({b, uint32_t(lights.size())});
+                lights.push_back({object, int64_t(f)});
+            }
+        }
+        else if (object->hasEmit()) {
+            // the emission of a sample point stands for the whole object
+            Intersection probe;
+            float pdf;
+            object->Sample(probe, pdf, Vector2f(0.5f), Vector2f(0.5f));
+            LightBounds b;
+            b.power = luminance(probe.emit) * object->getArea();
+            if (!(b.power > 0))
+                continue;
+            b.bounds = object->getBounds();
+            b.normals = DirectionCone::entireSphere();
+            objectLights[object].assign(1, lights.size());
+            items.push_back({b, uint32_t(lights.size())});
+            lights.push_back({object, -1});
+        }
+    }
+    if (items.empty())
+        return;
+    bitTrails.resize(lights.size());
+    nodes.reserve(2 * items.size() - 1);
+    buildRecursive(items, 0, items.size(), 0, 0);
+}
+
+LightBounds LightBVH::buildRecursive(std::vector<BuildLight>& items, size_t begin, size_t end, uint64_t bitTrail,
+                                     int depth)
+{
+    if (end - begin == 1) {
+        nodes.emplace_back(items[begin].bounds, items[begin].light, true);
+        bitTrails[items[begin].light] = bitTrail;
+        return items[begin].bounds;
+    }
+
+    LightBounds all;
+    Bounds3 centroidBounds;
+    for (size_t i = begin; i < end; ++i) {
+        all = Union(all, items[i].bounds);
+        centroidBounds = Union(centroidBounds, centroid(items[i].bounds.bounds));
+    }
+
+    // cheapest split between buckets along any axis
+    constexpr int nBuckets = 12;
+    float bestCost = std::numeric_limits<float>::infinity();
+    int bestDim = -1, bestBucket = -1;
+    auto bucketOf = [&](const BuildLight& item, int dim) {
+        float offset = centroidBounds.Offset(centroid(item.bounds.bounds))[dim];
+        return std::min(int(nBuckets * offset), nBuckets - 1);
+    };
+    // past depth 32 split by count, so the bit trails of all lights fit in 64 bits
+    for (int dim = 0; dim < 3 && depth < 32; ++dim) {
+        if (centroidBounds.pMax[dim] == centroidBounds.pMin[dim])
+            continue;
+        LightBounds buckets[nBuckets];
+        for (size_t i = begin; i < end; ++i) {
+            int b = bucketOf(items[i], dim);
+            buckets[b] = Union(buckets[b], items[i].bounds);
+        }
+        LightBounds below[nBuckets];
+        below[0] = buckets[0];
+        for (int b = 1; b < nBuckets; ++b)
+            below[b] = Union(below[b - 1], buckets[b]);
+        LightBounds above;
+        for (int b = nBuckets - 1; b > 0; --b) {
+            above = Union(above, buckets[b]);
+            float cost = evaluateCost(below[b - 1], all.bounds, dim) + evaluateCost(above, all.bounds, dim);
+            if (cost > 0 && cost < bestCost) {
+                bestCost = cost;
+                bestDim = dim;
+                bestBucket = b - 1;
+            }
+        }
+    }
+
+    size_t mid = begin;
+    if (bestDim >= 0)
+        mid = std::partition(items.begin() + begin, items.begin() + end, [&](const BuildLight& item) {
+                  return bucketOf(item, bestDim) <= bestBucket;
+              }) - items.begin();
+    if (mid == begin || mid == end) {
+        int dim = centroidBounds.maxExtent();
+        mid = (begin + end) / 2;
+        std::nth_element(items.begin() + begin, items.begin() + mid, items.begin() + end,
+                         [dim](const BuildLight& a, const BuildLight& b) {
+                             return centroid(a.bounds.bounds)[dim] < centroid(b.bounds.bounds)[dim];
+                         });
+    }
+
+    size_t nodeIndex = nodes.size();
+    nodes.emplace_back(all, 0, false);
+    buildRecursive(items, begin, mid, bitTrail, depth + 1);
+    nodes[nodeIndex].childOrLight = nodes.size();
+    buildRecursive(items, mid, end, bitTrail | (uint64_t(1) << depth), depth + 1);
+    return all;
+}
+
+float LightBVH::firstChildProbability(size_t nodeIndex, const Vector3f& p, const Vector3f& n) const
+{
+    float first = nodes[nodeIndex + 1].importance(p, n);
+    float second = nodes[nodes[nodeIndex].childOrLight].importance(p, n);
+    if (first + second == 0)
+        return -1;
+    return first / (first + second);
+}
+
+void LightBVH::sample(const Vector3f& p, const Vector3f& n, float u, const Vector2f& uFace, const Vector2f& uPoint,
+                      Intersection& pos, float& pdf) const
+{
+    pdf = 0;
+    // one number picks the whole path, rescaled after every choice
+    float pmf = 1;
+    // a single light is not checked on the way down
+    if (nodes.empty() || (nodes[0].leaf && nodes[0].importance(p, n) == 0))
+        return;
+
+    const float oneMinusEpsilon = 0x1.fffffep-1;
+    size_t i = 0;
+    while (!nodes[i].leaf) {
+        float p0 = firstChildProbability(i, p, n);
+        if (p0 < 0)
+            return;
+        if (u < p0) {
+            u = std::min(u / p0, oneMinusEpsilon);
+            pmf *= p0;
+            i = i + 1;
+        } else {
+            u = std::min((u - p0) / (1 - p0), oneMinusEpsilon);
+            pmf *= 1 - p0;
+            i = nodes[i].childOrLight;
+        }
+    }
+
+    const Light& light = lights[nodes[i].childOrLight];
+    if (light.face >= 0) {
+        const TriangleMesh& g = static_cast<Mesh*>(light.object)->geometry;
+        g.sampleFace(light.face, uPoint, pos);
+        pos.emit = g.material(light.face)->getEmission();
+        pdf = pmf / g.faceArea(light.face);
+    } else {
+        light.object->Sample(pos, pdf, uFace, uPoint);
+        pdf *= pmf;
+    }
+}
+
+float LightBVH::pmf(const Vector3f& p, const Vector3f& n, size_t light) const
+{
+    if (nodes.empty() || (nodes[0].leaf && nodes[0].importance(p, n) == 0))
+        return 0;
+    uint64_t trail = bitTrails[light];
+    float pmf = 1;
+    size_t i = 0;
+    while (!nodes[i].leaf) {
+        float p0 = firstChildProbability(i, p, n);
+        if (p0 < 0)
+            return 0;
+        if (trail & 1) {
+            pmf *= 1 - p0;
+            i = nodes[i].childOrLight;
+        } else {
+            pmf *= p0;
+            i = i + 1;
+        }
+        trail >>= 1;
+    }
+    return pmf;
+}
+
+int64_t LightBVH::find(const Object* object, int64_t face) const
+{
+    auto it = objectLights.find(object);
+    if (it == objectLights.end())
+        return -1;
+    const std::vector<int32_t>& faceLights = it->second;
+    if (faceLights.size() == 1 && lights[faceLights[0]].face < 0)
+        return faceLights[0];
+    return face >= 0 && size_t(face) < faceLights.size() ? faceLights[face] : -1;
+}
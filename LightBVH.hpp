@@ -0,0 +1,111 @@
+#pragma once
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+#include "Bounds3.hpp"
+#include "Intersection.hpp"
+#include "Object.hpp"
+#include "Vector.hpp"
+
+// Cone of directions around axis w, holding all directions with angle theta_o or
+// less to w: the normals of the emitters below a light BVH node.
+struct DirectionCone
+{
+    Vector3f w;
+    float cosTheta = 1;
+    bool empty = true;
+
+    DirectionCone() {}
+    DirectionCone(const Vector3f& w, float cosTheta) : w(w), cosTheta(cosTheta), empty(false) {}
+    static DirectionCone entireSphere() { return DirectionCone(Vector3f(0, 0, 1), -1); }
+};
+
+DirectionCone Union(const DirectionCone& a, const DirectionCone& b);
+
+// What the light BVH keeps of one emitter or a group of them: where they are,
+// where they face and how much they emit.
+struct LightBounds
+{
+    Bounds3 bounds;
+    DirectionCone normals;
+    // angle around the normals within which light is emitted; pi/2 for the
+    // one-sided diffuse emitters of this renderer
+    float cosTheta_e = 0;
+    float power = 0;
+};
+
+LightBounds Union(const LightBounds& a, const LightBounds& b);
+
+// Light hierarchy for scenes with many emitters (Conty Estevez and Kulla 2018,
+// as in pbrt-v4). Every emissive face of a mesh is a light of its own, other
+// emitting objects (spheres, instances) are one light each. The tree is built
+// with the surface area orientation heuristic; sample() walks it from the root
+// and picks each child with probability proportional to its importance at the
+// shading point, so lights that are far away, behind the shading point or facing
+// away from it are rarely sampled. pmf() gives the probability of the walk
+// ending at a given light, for weighting light hits found by other strategies.
+class LightBVH
+{
+public:
+    // an emissive face of a mesh, or a whole object if face < 0
+    struct Light
+    {
+        Object* object;
+        int64_t face;
+    };
+
+    // lights of objects; meshes contribute their emissive faces
+    void build(const std::vector<Object*>& objects);
+
+    bool empty() const { return lights.empty(); }
+
+    // pick a light for the shading point (p, n) with u and a point on it with
+    // uFace and uPoint (see Object::Sample); pdf is with respect to area, 0 if
+    // no light can reach the shading point
+    void sample(const Vector3f& p, const Vector3f& n, float u, const Vector2f& uFace, const Vector2f& uPoint,
+                Intersection& pos, float& pdf) const;
+
+    // probability of sample() picking lights[light] at (p, n)
+    float pmf(const Vector3f& p, const Vector3f& n, size_t light) const;
+    // index of the light the given face or object belongs to, -1 if it is none
+    int64_t find(const Object* object, int64_t face) const;
+
+    std::vector<Light> lights;
+
+private:
+    // LightBounds in the form importance() needs them, the bounds as bounding sphere
+    struct Node
+    {
+        Vector3f center;
+        float radius;
+        Vector3f w;
+        float cosTheta_o, sinTheta_o, cosTheta_e;
+        float power;
+        // leaf: index into lights, interior: the second child (the first one follows the node)
+        uint32_t childOrLight : 31;
+        uint32_t leaf : 1;
+
+        Node(const LightBounds& b, uint32_t childOrLight, bool leaf);
+        // conservative estimate of the light arriving at p on a surface with normal n
+        // (n = 0: no surface, e.g. a point in a medium)
+        float importance(const Vector3f& p, const Vector3f& n) const;
+    };
+
+    struct BuildLight
+    {
+        LightBounds bounds;
+        uint32_t light;
+    };
+
+    LightBounds buildRecursive(std::vector<BuildLight>& items, size_t begin, size_t end, uint64_t bitTrail, int depth);
+    // probability of going to the first child of interior node nodeIndex, -1 if
+    // neither child can reach (p, n)
+    float firstChildProbability(size_t nodeIndex, const Vector3f& p, const Vector3f& n) const;
+
+    std::vector<Node> nodes;
+    // path from the root to the leaf of each light, bit d set if the walk goes to the second child at depth d
+    std::vector<uint64_t> bitTrails;
+    // light of every face of an emitting mesh (-1 for faces that do not emit),
+    // a single entry for other objects
+    std::unordered_map<const Object*, std::vector<int32_t>> objectLights;
+};
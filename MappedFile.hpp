@@ -0,0 +1,62 @@
+#pragma once
+#include <string>
+#include <utility>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Read-only memory mapping of a whole file. An empty or missing file gives an
+// invalid mapping.
+class MappedFile
+{
+public:
+    MappedFile() = default;
+    explicit MappedFile(const std::string& path)
+    {
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+            return;
+        struct stat st;
+        if (fstat(fd, &st) == 0 && st.st_size > 0) {
+            void* p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (p != MAP_FAILED) {
+                mapped = p;
+                length = st.st_size;
+            }
+        }
+        close(fd);
+    }
+    MappedFile(MappedFile&& other) noexcept
+        : mapped(std::exchange(other.mapped, nullptr)), length(std::exchange(other.length, 0)) {}
+    MappedFile& operator=(MappedFile&& other) noexcept
+    {
+        std::swap(mapped, other.mapped);
+        std::swap(length, other.length);
+        return *this;
+    }
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+    ~MappedFile()
+    {
+        if (mapped)
+            munmap(mapped, length);
+    }
+
+    bool valid() const { return mapped != nullptr; }
+    const char* data() const { return static_cast<const char*>(mapped); }
+    size_t size() const { return length; }
+
+    // ask the kernel to read ahead, for files that are parsed front to back
+    void adviseSequential() const
+    {
+        if (mapped) {
+            madvise(mapped, length, MADV_SEQUENTIAL);
+            madvise(mapped, length, MADV_WILLNEED);
+        }
+    }
+
+private:
+    void* mapped = nullptr;
+    size_t length = 0;
+};
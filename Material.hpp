@@ -1,9 +1,12 @@
 #pragma once
 #include "Vector.hpp"
+#include "Sampler.hpp"
 #include "global.hpp"
 
 enum MaterialType {DIFFUSE, MICROFACET};
-enum SamplingType {UNIFORM, IS_COSWEIGHTED, IS_BRDF};
+// IS_MIXTURE picks the diffuse or the specular lobe of a MICROFACET material and
+// samples the latter from the GGX distribution of visible normals
+enum SamplingType {UNIFORM, IS_COSWEIGHTED, IS_BRDF, IS_MIXTURE};
 
 class Material{
 private:
@@ -58,10 +61,8 @@ private:
         // kt = 1 - kr;
     }
 
-    Vector3f toWorld(const Vector3f &a, const Vector3f &N){
-        // build a TNB coordinate, 
-        // then transform a in the TNB coordinate into the world coordinate
-        Vector3f B, C;
+    // build a TNB coordinate around N
+    void tangentFrame(const Vector3f &N, Vector3f &B, Vector3f &C){
         if (std::fabs(N.x) > std::fabs(N.y)){
             float invLen = 1.0f / std::sqrt(N.x * N.x + N.z * N.z);
             C = Vector3f(N.z * invLen, 0.0f, -N.x *invLen);
@@ -71,9 +72,63 @@ private:
             C = Vector3f(0.0f, N.z * invLen, -N.y *invLen);
         }
         B = crossProduct(C, N);
+    }
+
+    Vector3f toWorld(const Vector3f &a, const Vector3f &N){
+        // transform a in the TNB coordinate into the world coordinate
+        Vector3f B, C;
+        tangentFrame(N, B, C);
         return a.x * B + a.y * C + a.z * N;
     }
 
+    Vector3f toLocal(const Vector3f &a, const Vector3f &N){
+        Vector3f B, C;
+        tangentFrame(N, B, C);
+        return Vector3f(dotProduct(a, B), dotProduct(a, C), dotProduct(a, N));
+    }
+
+    // GGX normal distribution
+    float ggxD(float Ndoth){
+        float alpha2 = alpha*alpha;
+        float temp = (Ndoth*Ndoth*(alpha2-1.0f)+1);
+        return alpha2/(M_PI*temp*temp);
+    }
+
+    // Smith masking of the GGX distribution for a direction at cosTheta to the normal
+    float ggxG1(float cosTheta){
+        float alpha2 = alpha*alpha;
+        return 2 * cosTheta / (cosTheta + std::sqrt(alpha2 + (1 - alpha2) * cosTheta * cosTheta));
+    }
+
+    // visible normal of the GGX distribution for the local view direction v (Heitz 2018)
+    Vector3f sampleGGXVNDF(const Vector3f &v, float x_1, float x_2){
+        // stretch the view direction to the hemisphere configuration
+        Vector3f vh = normalize(Vector3f(alpha * v.x, alpha * v.y, v.z));
+        float lensq = vh.x * vh.x + vh.y * vh.y;
+        Vector3f T1 = lensq > 0 ? Vector3f(-vh.y, vh.x, 0) / std::sqrt(lensq) : Vector3f(1, 0, 0);
+        Vector3f T2 = crossProduct(vh, T1);
+        // uniform point on the projected half disk
+        float r = std::sqrt(x_1), phi = 2 * M_PI * x_2;
+        float t1 = r * std::cos(phi), t2 = r * std::sin(phi);
+        float s = 0.5f * (1.0f + vh.z);
+        t2 = (1.0f - s) * std::sqrt(1.0f - t1 * t1) + s * t2;
+        Vector3f nh = t1 * T1 + t2 * T2 + std::sqrt(std::max(0.0f, 1.0f - t1 * t1 - t2 * t2)) * vh;
+        // and back to the ellipsoid configuration
+        return normalize(Vector3f(alpha * nh.x, alpha * nh.y, std::max(0.0f, nh.z)));
+    }
+
+    // IS_MIXTURE: probability of sampling the specular lobe, from ks and the
+    // Schlick Fresnel term at the view direction wo against the diffuse albedo
+    float specularProbability(const Vector3f &wo, const Vector3f &N){
+        if (m_type != MICROFACET)
+            return 0.0f;
+        float NdotWo = std::max(dotProduct(N, wo), 0.0f);
+        Vector3f F = F0 + (Vector3f(1.0f)-F0)*pow(1-NdotWo,5);
+        float specular = ks * (F.x + F.y + F.z) / 3;
+        float diffuse = (1 - ks) * (rho.x + rho.y + rho.z) / 3;
+        return specular + diffuse > 0 ? specular / (specular + diffuse) : 0.5f;
+    }
+
 public:
     MaterialType m_type;
     SamplingType m_sample;
@@ -92,7 +147,7 @@ public:
     inline bool hasEmission();
 
     // sample a ray by Material properties
-    inline Vector3f sample(const Vector3f &wo, const Vector3f &N);
+    inline Vector3f sample(const Vector3f &wo, const Vector3f &N, Sampler &sampler);
     // given a ray, calculate the PdF of this ray
     inline float pdf(const Vector3f &wi, const Vector3f &wo, const Vector3f &N);
     // given a ray, calculate the contribution of this ray
@@ -113,12 +168,16 @@ bool Material::hasEmission() {
     else return false;
 }
 
-Vector3f Material::sample(const Vector3f &wo, const Vector3f &N){
+Vector3f Material::sample(const Vector3f &wo, const Vector3f &N, Sampler &sampler){
+    // the same dimensions whatever the strategy, so the sampler's dimensions
+    // line up from bounce to bounce
+    float lobe = sampler.get1D();
+    Vector2f u = sampler.get2D();
+    float x_1 = u.x, x_2 = u.y;
     switch(m_sample){
         case UNIFORM:
         {
             // uniform sample on the hemisphere
-            float x_1 = get_random_float(), x_2 = get_random_float();
             float z = std::fabs(1.0f - 2.0f * x_1);
             float r = std::sqrt(1.0f - z * z), phi = 2 * M_PI * x_2;
             Vector3f localRay(r*std::cos(phi), r*std::sin(phi), z);
@@ -126,7 +185,17 @@ Vector3f Material::sample(const Vector3f &wo, const Vector3f &N){
         }
         case IS_COSWEIGHTED:
         {
-            float x_1 = get_random_float(), x_2 = get_random_float();
+            float z = std::sqrt(1.0f - x_1);
+            float r = std::sqrt(x_1), phi = 2 * M_PI * x_2;
+            Vector3f localRay(r*std::cos(phi), r*std::sin(phi), z);
+            return toWorld(localRay, N).normalized();
+        }
+        case IS_MIXTURE:
+        {
+            if (dotProduct(wo, N) > 0.0f && lobe < specularProbability(wo, N)) {
+                Vector3f wh = toWorld(sampleGGXVNDF(toLocal(wo, N), x_1, x_2), N);
+                return normalize(2*dotProduct(wo, wh)*wh-wo);
+            }
             float z = std::sqrt(1.0f - x_1);
             float r = std::sqrt(x_1), phi = 2 * M_PI * x_2;
             Vector3f localRay(r*std::cos(phi), r*std::sin(phi), z);
@@ -134,7 +203,6 @@ Vector3f Material::sample(const Vector3f &wo, const Vector3f &N){
         }
         case IS_BRDF:
         {
-            float x_1 = get_random_float(), x_2 = get_random_float();
             float a = (1-x_1)/(x_1*(alpha*alpha-1)+1);
             float z = std::sqrt(a);
             float r = std::sqrt(1-a), phi = 2 * M_PI * x_2;
@@ -145,7 +213,6 @@ Vector3f Material::sample(const Vector3f &wo, const Vector3f &N){
         }
         default:
         {
-            float x_1 = get_random_float(), x_2 = get_random_float();
             float z = std::fabs(1.0f - 2.0f * x_1);
             float r = std::sqrt(1.0f - z * z), phi = 2 * M_PI * x_2;
             Vector3f localRay(r*std::cos(phi), r*std::sin(phi), z);
@@ -191,6 +258,21 @@ float Material::pdf(const Vector3f &wi, const Vector3f &wo, const Vector3f &N){
                 return 0.0f;
             break;
         }
+        case IS_MIXTURE:
+        {
+            // wi is the view direction here, wo the sampled one
+            float NdotWi = dotProduct(wi, N), NdotWo = dotProduct(wo, N);
+            if (NdotWo <= 0.0f)
+                return 0.0f;
+            float diffusePdf = NdotWo / M_PI;
+            if (NdotWi <= 0.0f)
+                return diffusePdf;
+            float pSpecular = specularProbability(wi, N);
+            float Ndoth = dotProduct(N, (wo + wi).normalized());
+            // visible normal pdf D_v(h) = G1(wi) D(h) max(0, wi.h) / NdotWi, times the 1 / (4 wi.h) of the reflection
+            float specularPdf = Ndoth > 0.0f ? ggxG1(NdotWi) * ggxD(Ndoth) * 0.25f / NdotWi : 0.0f;
+            return pSpecular * specularPdf + (1 - pSpecular) * diffusePdf;
+        }
         default:
         {
             if (dotProduct(wo, N) > 0.0f)
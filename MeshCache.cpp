@@ -0,0 +1,186 @@
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "MeshCache.hpp"
+
+static_assert(sizeof(Vector3f) == 3 * sizeof(float), "cached vertices are stored as packed float triples");
+
+struct MeshCache::Header
+{
+    char magic[8];
+    uint32_t version;
+    // BVHAccel::SplitMethod of the cached BVH, noBVH if there is none
+    uint32_t splitMethod;
+    // identify the OBJ file the cache was made from
+    uint64_t sourceSize;
+    int64_t sourceMtime;
+    uint64_t numVertices, numIndices, numNodes, numFaces;
+    // byte offsets of the sections from the start of the file
+    uint64_t verticesOffset, indicesOffset, nodesOffset, facesOffset;
+    uint64_t fileSize;
+
+    static constexpr uint32_t noBVH = ~0u;
+};
+
+namespace
+{
+    const char cacheMagic[8] = {'R', 'T', 'M', 'E', 'S', 'H', '\0', '\0'};
+    constexpr uint64_t sectionAlignment = 64;
+
+    uint64_t alignSection(uint64_t offset)
+    {
+        return (offset + sectionAlignment - 1) / sectionAlignment * sectionAlignment;
+    }
+
+    bool statSource(const std::string& path, uint64_t& size, int64_t& mtime)
+    {
+        struct stat st;
+        if (stat(path.c_str(), &st) != 0)
+            return false;
+        size = st.st_size;
+        mtime = int64_t(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+        return true;
+    }
+}
+
+std::shared_ptr<MeshCache> MeshCache::load(const std::string& objPath)
+{
+    uint64_t sourceSize;
+    int64_t sourceMtime;
+    if (!enabled || !statSource(objPath, sourceSize, sourceMtime))
+        return nullptr;
+
+    MappedFile file(path(objPath));
+    size_t size = file.size();
+    if (!file.valid() || size < sizeof(Header))
+        return nullptr;
+    std::shared_ptr<MeshCache> cache(new MeshCache(std::move(file)));
+
+    const Header& h = cache->header();
+    if (std::memcmp(h.magic, cacheMagic, sizeof(cacheMagic)) != 0 || h.version != version ||
+        h.fileSize != size || h.sourceSize != sourceSize || h.sourceMtime != sourceMtime)
+        return nullptr;
+    if (h.verticesOffset + h.numVertices * sizeof(Vector3f) > size ||
+        h.indicesOffset + h.numIndices * sizeof(uint32_t) > size ||
+        h.nodesOffset + h.numNodes * sizeof(LinearBVHNode) > size ||
+        h.facesOffset + h.numFaces * sizeof(uint32_t) > size)
+        return nullptr;
+    if (!cache->validContents())
+        return nullptr;
+    return cache;
+}
+
+// One pass over the mapped sections: every index the renderer follows has to
+// stay inside its array, and the tree has to fit the traversal stacks.
+bool MeshCache::validContents() const
+{
+    const Header& h = header();
+    if (h.numIndices % 3 != 0)
+        return false;
+    const uint32_t* indices = section<uint32_t>(h.indicesOffset);
+    for (uint64_t i = 0; i < h.numIndices; ++i)
+        if (indices[i] >= h.numVertices)
+            return false;
+    if (h.numNodes == 0)
+        return true;
+
+    // leaves start at packet boundaries, fillPackets() makes numFaces / width packets
+    if (h.splitMethod == Header::noBVH || h.numFaces % TrianglePacket::width != 0)
+        return false;
+    const uint32_t* faces = section<uint32_t>(h.facesOffset);
+    for (uint64_t i = 0; i < h.numFaces; ++i)
+        if (faces[i] >= h.numIndices / 3)
+            return false;
+
+    // nodes are stored depth first, children come after their parent
+    const LinearBVHNode* nodes = section<LinearBVHNode>(h.nodesOffset);
+    std::vector<uint8_t> depth(h.numNodes, 0);
+    for (uint64_t i = 0; i < h.numNodes; ++i) {
+        const LinearBVHNode& node = nodes[i];
+        if (node.nPrimitives > 0) {
+            if (node.primitivesOffset < 0 || node.primitivesOffset % TrianglePacket::width != 0 ||
+                uint64_t(node.primitivesOffset) + node.nPrimitives > h.numFaces)
+                return false;
+            continue;
+        }
+        if (depth[i] + 1 >= BVHAccel::maxDepth || i + 1 >= h.numNodes ||
+            node.secondChildOffset <= int64_t(i + 1) || uint64_t(node.secondChildOffset) >= h.numNodes)
+            return false;
+        depth[i + 1] = std::max<uint8_t>(depth[i + 1], depth[i] + 1);
+        depth[node.secondChildOffset] = std::max<uint8_t>(depth[node.secondChildOffset], depth[i] + 1);
+    }
+    return true;
+}
+
+bool MeshCache::write(const std::string& objPath, const TriangleMesh& geometry, const BVHAccel* bvh)
+{
+    Header h = {};
+    if (!enabled || !statSource(objPath, h.sourceSize, h.sourceMtime))
+        return false;
+    std::memcpy(h.magic, cacheMagic, sizeof(cacheMagic));
+    h.version = version;
+    h.splitMethod = bvh ? uint32_t(bvh->splitMethod) : Header::noBVH;
+    h.numVertices = geometry.numVertices;
+    h.numIndices = geometry.numIndices;
+    h.numNodes = bvh ? bvh->nodes.size() : 0;
+    h.numFaces = bvh ? bvh->faces.size() : 0;
+    h.verticesOffset = alignSection(sizeof(Header));
+    h.indicesOffset = alignSection(h.verticesOffset + h.numVertices * sizeof(Vector3f));
+    h.nodesOffset = alignSection(h.indicesOffset + h.numIndices * sizeof(uint32_t));
+    h.facesOffset = alignSection(h.nodesOffset + h.numNodes * sizeof(LinearBVHNode));
+    h.fileSize = h.facesOffset + h.numFaces * sizeof(uint32_t);
+
+    std::string target = path(objPath);
+    // unique per process and per write, meshes of the same file may be loaded concurrently
+    static std::atomic<uint32_t> writeCount{0};
+    std::string tmp = target + ".tmp" + std::to_string(getpid()) + "." + std::to_string(writeCount++);
+    FILE* file = fopen(tmp.c_str(), "wb");
+    if (!file) {
+        printf("Cannot write mesh cache %s\n", target.c_str());
+        return false;
+    }
+    auto writeAt = [file](uint64_t offset, const void* p, size_t bytes) {
+        return fseek(file, offset, SEEK_SET) == 0 && (bytes == 0 || fwrite(p, bytes, 1, file) == 1);
+    };
+    bool ok = writeAt(0, &h, sizeof(h)) &&
+              writeAt(h.verticesOffset, geometry.vertices, h.numVertices * sizeof(Vector3f)) &&
+              writeAt(h.indicesOffset, geometry.indices, h.numIndices * sizeof(uint32_t)) &&
+              (!bvh || writeAt(h.nodesOffset, bvh->nodes.data(), h.numNodes * sizeof(LinearBVHNode))) &&
+              (!bvh || writeAt(h.facesOffset, bvh->faces.data(), h.numFaces * sizeof(uint32_t)));
+    ok = fclose(file) == 0 && ok;
+    if (ok)
+        ok = rename(tmp.c_str(), target.c_str()) == 0;
+    if (!ok) {
+        remove(tmp.c_str());
+        printf("Cannot write mesh cache %s\n", target.c_str());
+    }
+    return ok;
+}
+
+void MeshCache::getGeometry(TriangleMesh& geometry)
+{
+    const Header& h = header();
+    geometry.vertexStorage.clear();
+    geometry.indexStorage.clear();
+    geometry.vertices = section<Vector3f>(h.verticesOffset);
+    geometry.indices = section<uint32_t>(h.indicesOffset);
+    geometry.numVertices = h.numVertices;
+    geometry.numIndices = h.numIndices;
+    geometry.mapping = shared_from_this();
+}
+
+BVHAccel* MeshCache::getBVH(const TriangleMesh* geometry, Object* owner, BVHAccel::SplitMethod splitMethod) const
+{
+    const Header& h = header();
+    if (h.splitMethod != uint32_t(splitMethod) || h.numNodes == 0)
+        return nullptr;
+    // the BVH keeps its arrays in vectors, restoring it is one copy instead of a build
+    const LinearBVHNode* nodes = section<LinearBVHNode>(h.nodesOffset);
+    const uint32_t* faces = section<uint32_t>(h.facesOffset);
+    return new BVHAccel(geometry, owner, splitMethod, std::vector<LinearBVHNode>(nodes, nodes + h.numNodes),
+                        std::vector<uint32_t>(faces, faces + h.numFaces));
+}
@@ -0,0 +1,46 @@
+#pragma once
+#include <cstdlib>
+#include <memory>
+#include <string>
+#include "BVH.hpp"
+#include "MappedFile.hpp"
+#include "TriangleMesh.hpp"
+
+// Binary cache of a parsed OBJ file, stored next to it as <file>.rtcache. It
+// holds the vertex and index buffers and optionally the mesh BVH, each section
+// 64 byte aligned so the file can be memory mapped and used in place. A cache
+// is only used while the size and modification time of the OBJ file match the
+// ones recorded in it and its format version is current.
+class MeshCache : public std::enable_shared_from_this<MeshCache>
+{
+public:
+    // bumped whenever the layout of the file or of the cached structs changes
+    static constexpr uint32_t version = 2;
+    // set RT_NO_MESH_CACHE (or pass --no-mesh-cache) to always parse the OBJ files
+    static inline bool enabled = std::getenv("RT_NO_MESH_CACHE") == nullptr;
+
+    static std::string path(const std::string& objPath) { return objPath + ".rtcache"; }
+    // maps the cache of objPath, nullptr if there is none or it is stale
+    static std::shared_ptr<MeshCache> load(const std::string& objPath);
+    // (re)writes the cache of objPath with geometry and, if given, its BVH; the
+    // file is written under a temporary name and renamed, so mappings of the old
+    // cache stay valid
+    static bool write(const std::string& objPath, const TriangleMesh& geometry, const BVHAccel* bvh);
+
+    // point the vertex and index buffers of geometry into the mapping
+    void getGeometry(TriangleMesh& geometry);
+    // restore the cached BVH if it was built with splitMethod, else nullptr
+    BVHAccel* getBVH(const TriangleMesh* geometry, Object* owner, BVHAccel::SplitMethod splitMethod) const;
+
+private:
+    struct Header;
+
+    explicit MeshCache(MappedFile file) : file(std::move(file)) {}
+    // indices, faces and tree nodes of the mapping point inside their sections
+    bool validContents() const;
+    const Header& header() const { return *reinterpret_cast<const Header*>(file.data()); }
+    template <typename T>
+    const T* section(uint64_t offset) const { return reinterpret_cast<const T*>(file.data() + offset); }
+
+    MappedFile file;
+};
@@ -0,0 +1,187 @@
+#include <algorithm>
+#include <charconv>
+#include <cstring>
+#include "ObjParser.hpp"
+#include "MappedFile.hpp"
+#include "TaskScheduler.hpp"
+
+namespace
+{
+    // position index of a face corner; corners given relative to the end of the
+    // vertex list (negative in the file) are relative to the first vertex of the
+    // chunk until the vertex offset of the chunk is known
+    struct Corner
+    {
+        int64_t index;
+        bool relative;
+    };
+
+    struct Chunk
+    {
+        std::vector<Vector3f> vertices;
+        std::vector<uint32_t> indices;
+        // (slot in indices, vertex index relative to the first vertex of the chunk)
+        std::vector<std::pair<size_t, int64_t>> relative;
+        std::string error;
+    };
+
+    inline bool isBlank(char c) { return c == ' ' || c == '\t'; }
+    inline bool isLineEnd(char c) { return c == '\n' || c == '\r'; }
+
+    inline const char* skipBlanks(const char* p, const char* end)
+    {
+        while (p < end && isBlank(*p))
+            ++p;
+        return p;
+    }
+
+    inline const char* nextLine(const char* p, const char* end)
+    {
+        const void* nl = std::memchr(p, '\n', end - p);
+        return nl ? static_cast<const char*>(nl) + 1 : end;
+    }
+
+    inline bool parseFloat(const char*& p, const char* end, float& value)
+    {
+        p = skipBlanks(p, end);
+        // from_chars does not accept a leading plus
+        if (p < end && *p == '+')
+            ++p;
+        auto result = std::from_chars(p, end, value);
+        if (result.ec != std::errc())
+            return false;
+        p = result.ptr;
+        return true;
+    }
+
+    // one "v", "v/vt", "v//vn" or "v/vt/vn" corner, only the position index is kept
+    inline bool parseCorner(const char*& p, const char* end, size_t chunkVertices, Corner& corner)
+    {
+        long long value;
+        auto result = std::from_chars(p, end, value);
+        if (result.ec != std::errc() || value == 0)
+            return false;
+        p = result.ptr;
+        while (p < end && !isBlank(*p) && !isLineEnd(*p))
+            ++p;
+        if (value > 0)
+            corner = {value - 1, false};
+        else
+            corner = {int64_t(chunkVertices) + value, true};
+        return true;
+    }
+
+    void parseChunk(const char* p, const char* end, Chunk& chunk)
+    {
+        std::vector<Corner> corners;
+        auto emit = [&chunk](const Corner& corner) {
+            if (corner.relative)
+                chunk.relative.emplace_back(chunk.indices.size(), corner.index);
+            chunk.indices.push_back(uint32_t(corner.index));
+        };
+
+        while (p < end) {
+            const char* line = skipBlanks(p, end);
+            p = nextLine(line, end);
+            if (end - line < 2 || !isBlank(line[1]))
+                continue;
+
+            if (line[0] == 'v') {
+                Vector3f v;
+                const char* q = line + 1;
+                if (!parseFloat(q, end, v.x) || !parseFloat(q, end, v.y) || !parseFloat(q, end, v.z)) {
+                    chunk.error = "bad vertex: " + std::string(line, std::find_if(line, p, isLineEnd));
+                    return;
+                }
+                chunk.vertices.push_back(v);
+            }
+            else if (line[0] == 'f') {
+                corners.clear();
+                const char* q = line + 1;
+                while (true) {
+                    q = skipBlanks(q, end);
+                    if (q == end || isLineEnd(*q))
+                        break;
+                    Corner corner;
+                    if (!parseCorner(q, end, chunk.vertices.size(), corner)) {
+                        chunk.error = "bad face: " + std::string(line, std::find_if(line, p, isLineEnd));
+                        return;
+                    }
+                    corners.push_back(corner);
+                }
+                if (corners.size() == 3) {
+                    // almost every face of a mesh exported for rendering
+                    emit(corners[0]);
+                    emit(corners[1]);
+                    emit(corners[2]);
+                }
+                else if (corners.size() > 3) {
+                    for (size_t k = 1; k + 1 < corners.size(); ++k) {
+                        emit(corners[0]);
+                        emit(corners[k]);
+                        emit(corners[k + 1]);
+                    }
+                }
+                else {
+                    chunk.error = "face with less than three corners: " +
+                                  std::string(line, std::find_if(line, p, isLineEnd));
+                    return;
+                }
+            }
+        }
+    }
+}
+
+bool ObjParser::parse(const std::string& path)
+{
+    vertices.clear();
+    indices.clear();
+    error.clear();
+    MappedFile file(path);
+    if (!file.valid()) {
+        error = "cannot read " + path;
+        return false;
+    }
+    file.adviseSequential();
+    bytes = file.size();
+    const char* data = file.data();
+    const char* end = data + bytes;
+
+    // split at line starts, one task per chunk
+    size_t numChunks = std::clamp<size_t>(bytes / minChunkSize, 1, 1024);
+    std::vector<const char*> starts(numChunks + 1, end);
+    starts[0] = data;
+    for (size_t i = 1; i < numChunks; ++i)
+        starts[i] = std::max(starts[i - 1], nextLine(data + bytes * i / numChunks - 1, end));
+    std::vector<Chunk> chunks(numChunks);
+    parallel_for(0, numChunks, 1, [&](int64_t i) { parseChunk(starts[i], starts[i + 1], chunks[i]); });
+
+    std::vector<size_t> vertexOffset(numChunks + 1, 0), indexOffset(numChunks + 1, 0);
+    for (size_t i = 0; i < numChunks; ++i) {
+        if (!chunks[i].error.empty()) {
+            error = path + ": " + chunks[i].error;
+            return false;
+        }
+        vertexOffset[i + 1] = vertexOffset[i] + chunks[i].vertices.size();
+        indexOffset[i + 1] = indexOffset[i] + chunks[i].indices.size();
+    }
+
+    size_t numVertices = vertexOffset[numChunks];
+    vertices.resize(numVertices);
+    indices.resize(indexOffset[numChunks]);
+    std::vector<char> badIndex(numChunks, 0);
+    parallel_for(0, numChunks, 1, [&](int64_t i) {
+        Chunk& chunk = chunks[i];
+        for (auto& [slot, local] : chunk.relative)
+            chunk.indices[slot] = uint32_t(int64_t(vertexOffset[i]) + local);
+        for (uint32_t index : chunk.indices)
+            badIndex[i] |= index >= numVertices;
+        std::copy(chunk.vertices.begin(), chunk.vertices.end(), vertices.begin() + vertexOffset[i]);
+        std::copy(chunk.indices.begin(), chunk.indices.end(), indices.begin() + indexOffset[i]);
+    });
+    if (std::find(badIndex.begin(), badIndex.end(), 1) != badIndex.end()) {
+        error = path + ": face refers to a vertex that does not exist";
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,26 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "Vector.hpp"
+
+// Fast loader for the geometry of OBJ files, used instead of objl::Loader when
+// meshes are loaded. The file is memory mapped and split into chunks at line
+// boundaries that are parsed in parallel; numbers are read with std::from_chars.
+// Only positions ("v") and faces ("f") are read, everything else is skipped.
+// The OBJ vertex list becomes the vertex buffer as is and every face refers to
+// it by index; faces with more than three corners are split into a triangle fan.
+struct ObjParser
+{
+    std::vector<Vector3f> vertices;
+    std::vector<uint32_t> indices;
+    // size of the parsed file, for throughput reports
+    size_t bytes = 0;
+    // why parse() failed
+    std::string error;
+
+    bool parse(const std::string& path);
+
+    // chunks smaller than this are not worth a task of their own
+    static constexpr size_t minChunkSize = 1 << 20;
+};
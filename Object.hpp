@@ -6,14 +6,22 @@
 #include "Ray.hpp"
 #include "Intersection.hpp"
 
+struct BVHBuildOptions;
+
 class Object
 {
 public:
     Object() {}
     virtual ~Object() {}
     virtual Intersection getIntersection(Ray _ray) = 0;
+    // any-hit test for shadow rays: is there an intersection with t in (0, ray.t_max)?
+    virtual bool intersectP(const Ray& ray) = 0;
     virtual Bounds3 getBounds()=0;
     virtual float getArea()=0;
-    virtual void Sample(Intersection &pos, float &pdf)=0;
+    // a point on the surface, pdf with respect to area; uFace picks the face of
+    // objects made of several, uPoint the point on it
+    virtual void Sample(Intersection &pos, float &pdf, const Vector2f &uFace, const Vector2f &uPoint)=0;
     virtual bool hasEmit()=0;
+    // build the object's own acceleration structure, if it has one
+    virtual void buildBVH(const BVHBuildOptions&) {}
 };
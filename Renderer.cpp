@@ -1,12 +1,146 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
 #include <fstream>
+#include <string>
+#include <atomic>
+#include <mutex>
 #include "Scene.hpp"
 #include "Renderer.hpp"
+#include "TaskScheduler.hpp"
 
-#include "ThreadPool.hpp"
+struct Tile
+{
+    int x0, y0, x1, y1;
+};
+
+// Sum of the samples of a pixel, with the running mean and variance of their
+// luminance (Welford's algorithm) for adaptive sampling
+struct PixelEstimate
+{
+    Vector3f sum;
+    int n = 0;
+    double mean = 0, m2 = 0;
+
+    void add(const Vector3f& L)
+    {
+        sum += L;
+        ++n;
+        double x = luminance(L), delta = x - mean;
+        mean += delta / n;
+        m2 += delta * (x - mean);
+    }
+
+    // standard error of the mean luminance relative to the mean; dark pixels are
+    // measured against a floor so that black ones do not need an exact zero
+    float relativeError() const
+    {
+        if (n < 2)
+            return kInfinity;
+        double variance = m2 / (n - 1);
+        return std::sqrt(variance / n) / std::max(mean, 1e-2);
+    }
+};
+
+// What a tile keeps from one pass to the next: the camera rays and hits of its
+// pixels (strata), held only while the tile may be revisited by a progressive
+// pass, and the samples taken so far
+struct TileState
+{
+    std::vector<Ray> primaryRays;
+    std::vector<Intersection> primaryHits;
+    std::vector<PixelEstimate> estimates;
+};
+
+// interleave the lower 16 bits of x and y into a Morton (Z-order) code
+static uint32_t mortonCode2D(uint32_t x, uint32_t y)
+{
+    auto spread = [](uint32_t v) {
+        v &= 0x0000ffff;
+        v = (v | (v << 8)) & 0x00ff00ff;
+        v = (v | (v << 4)) & 0x0f0f0f0f;
+        v = (v | (v << 2)) & 0x33333333;
+        v = (v | (v << 1)) & 0x55555555;
+        return v;
+    };
+    return spread(x) | (spread(y) << 1);
+}
+
+// Split the image into tileSize x tileSize tiles and sort them by the requested order.
+static std::vector<Tile> makeTiles(int width, int height, int tileSize, TileOrder order)
+{
+    int nx = (width + tileSize - 1) / tileSize;
+    int ny = (height + tileSize - 1) / tileSize;
+
+    std::vector<std::pair<float, Tile>> keyed;
+    keyed.reserve(nx * ny);
+    for (int ty = 0; ty < ny; ++ty) {
+        for (int tx = 0; tx < nx; ++tx) {
+            Tile tile{tx * tileSize, ty * tileSize,
+                      std::min((tx + 1) * tileSize, width),
+                      std::min((ty + 1) * tileSize, height)};
+            float key = 0;
+            switch (order) {
+            case TileOrder::SCANLINE:
+                key = ty * nx + tx;
+                break;
+            case TileOrder::MORTON:
+                key = mortonCode2D(tx, ty);
+                break;
+            case TileOrder::SPIRAL:
+            {
+                // ring index around the center tile first, then angle inside the ring
+                float dx = tx - (nx - 1) * 0.5f, dy = ty - (ny - 1) * 0.5f;
+                float ring = std::ceil(std::max(std::fabs(dx), std::fabs(dy)));
+                float angle = std::atan2(dy, dx) + M_PI;
+                key = ring * 8 + angle;
+                break;
+            }
+            }
+            keyed.emplace_back(key, tile);
+        }
+    }
+    std::stable_sort(keyed.begin(), keyed.end(),
+                     [](auto& a, auto& b) { return a.first < b.first; });
+
+    std::vector<Tile> tiles;
+    tiles.reserve(keyed.size());
+    for (auto& k : keyed)
+        tiles.push_back(k.second);
+    return tiles;
+}
+
+// Save the frame buffer as binary PPM. The image is written to path.tmp and
+// renamed over path, so whoever reads path sees either the previous image or
+// the complete new one, never a partial file.
+static bool writeImage(const std::string& path, const std::vector<Vector3f>& framebuffer, int width, int height)
+{
+    std::string tmpPath = path + ".tmp";
+    FILE* fp = fopen(tmpPath.c_str(), "wb");
+    if (!fp)
+        return false;
+    (void)fprintf(fp, "P6\n%d %d\n255\n", width, height);
+    for (auto i = 0; i < height * width; ++i) {
+        unsigned char color[3];
+        color[0] = (unsigned char)(255 * std::pow(clamp(0, 1, framebuffer[i].x), 0.6f));
+        color[1] = (unsigned char)(255 * std::pow(clamp(0, 1, framebuffer[i].y), 0.6f));
+        color[2] = (unsigned char)(255 * std::pow(clamp(0, 1, framebuffer[i].z), 0.6f));
+        fwrite(color, 1, 3, fp);
+    }
+    bool written = !ferror(fp);
+    written = fclose(fp) == 0 && written;
+    if (!written || std::rename(tmpPath.c_str(), path.c_str()) != 0) {
+        std::remove(tmpPath.c_str());
+        return false;
+    }
+    return true;
+}
 
-// The main render function. This where we iterate over all pixels in the image,
-// generate primary rays and cast these rays into the scene. The content of the
-// frame buffer is saved to a file.
+// The main render function. The image is cut into tiles which are run as tasks
+// on the shared work stealing scheduler; every task adds the samples of its tile
+// to the tile's estimates and writes the tile to the frame buffer. A plain render
+// is a single pass to spp; a progressive one runs passes of doubling sample counts
+// and saves the frame buffer after each of them, until spp or the time limit.
 void Renderer::Render(const Scene& scene)
 {
     std::vector<Vector3f> framebuffer(scene.width * scene.height);
@@ -14,51 +148,193 @@ void Renderer::Render(const Scene& scene)
     float scale = tan(deg2rad(scene.fov * 0.5));
     float imageAspectRatio = scene.width / (float)scene.height;
     Vector3f eye_pos(278, 273, -800);
-    int m = 0;
 
-    // change the spp value to change sample amount
-    int spp = 512;
     std::cout << "SPP: " << spp << "\n";
-    for (uint32_t j = 0; j < scene.height; ++j) {
-        for (uint32_t i = 0; i < scene.width; ++i) {
-            // generate primary ray direction
-            float x = (2 * (i + 0.5) / (float)scene.width - 1) *
-                      imageAspectRatio * scale;
-            float y = (1 - 2 * (j + 0.5) / (float)scene.height) * scale;
-
-            Vector3f dir = normalize(Vector3f(-x, y, 1));
-
-            ThreadPool pool(6);
-            std::vector< std::future<Vector3f> > results;
-
-            for (int k = 0; k < spp; k++){
-                results.emplace_back(pool.enqueue(
-                    [&scene, eye_pos, dir] {
-                        // return scene.castRay(Ray(eye_pos, dir), 0);
-                        Ray ray = Ray(eye_pos, dir);
-                        Intersection intersection = scene.intersect(ray);
-                        return intersection.happened?scene.castRay(ray, intersection, 0):Vector3f(0);
-                    }));
+
+    std::vector<Tile> tiles = makeTiles(scene.width, scene.height, std::max(1, tileSize), tileOrder);
+    std::vector<TileState> states(tiles.size());
+    // counted under the mutex, so the progress printed never goes backwards
+    size_t tilesDone = 0;
+    std::mutex progressMutex;
+
+    int strata = std::max(1, primaryStrata);
+    int nStrata = strata * strata;
+    // sampler dimensions taken by the camera rays, the paths start after them
+    uint32_t cameraDimensions = strata > 1 ? 2 : 0;
+    std::unique_ptr<Sampler> samplerPrototype = Sampler::create(samplerType, seed);
+    bool adaptive = adaptiveThreshold > 0;
+
+    auto start = std::chrono::steady_clock::now();
+    auto elapsed = [&] { return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count(); };
+
+    // take tile t from previousSpp to targetSpp samples per pixel (on average
+    // with adaptive sampling)
+    auto renderTile = [&](size_t t, int previousSpp, int targetSpp) {
+        const Tile& tile = tiles[t];
+        TileState& state = states[t];
+        int tileWidth = tile.x1 - tile.x0;
+        int tilePixels = (tile.y1 - tile.y0) * tileWidth;
+        std::vector<Ray>& primaryRays = state.primaryRays;
+        std::vector<Intersection>& primaryHits = state.primaryHits;
+        std::vector<PixelEstimate>& estimates = state.estimates;
+
+        std::unique_ptr<Sampler> sampler = samplerPrototype->clone();
+        // G-buffer pass: the camera ray of every pixel (stratum) is traced once,
+        // all samples of the pixel continue the path from the cached hit
+        if (estimates.empty()) {
+            primaryRays.reserve(tilePixels * nStrata);
+            primaryHits.reserve(tilePixels * nStrata);
+            for (int j = tile.y0; j < tile.y1; ++j) {
+                for (int i = tile.x0; i < tile.x1; ++i) {
+                    for (int s = 0; s < nStrata; ++s) {
+                        // a single stratum is the pixel center; several are jittered, the
+                        // position in stratum s is the camera sample of pixel sample s,
+                        // the first sample to use it
+                        Vector2f u(0.5f);
+                        if (cameraDimensions > 0) {
+                            sampler->startPixelSample(i, j, s);
+                            u = sampler->get2D();
+                        }
+                        float sx = (s % strata + u.x) / strata, sy = (s / strata + u.y) / strata;
+                        float x = (2 * (i + sx) / (float)scene.width - 1) *
+                                  imageAspectRatio * scale;
+                        float y = (1 - 2 * (j + sy) / (float)scene.height) * scale;
+
+                        Vector3f dir = normalize(Vector3f(-x, y, 1));
+                        primaryRays.emplace_back(eye_pos, dir);
+                        primaryHits.push_back(scene.intersect(primaryRays.back()));
+                    }
+                }
             }
-            for(auto && result : results){
-                framebuffer[m] += result.get() / spp;
+            estimates.resize(tilePixels);
+        }
+
+        // the next count samples of pixel p
+        auto samplePixel = [&](int p, int count) {
+            PixelEstimate& e = estimates[p];
+            int i = tile.x0 + p % tileWidth, j = tile.y0 + p / tileWidth;
+            for (int c = 0; c < count; ++c) {
+                int k = e.n;
+                int g = p * nStrata + k % nStrata;
+                Vector3f L = 0.0f;
+                if (primaryHits[g].happened) {
+                    sampler->startPixelSample(i, j, k, cameraDimensions);
+                    L = scene.castRay(primaryRays[g], primaryHits[g], 0, *sampler);
+                }
+                e.add(L);
             }
+        };
 
-            m++;
+        if (!adaptive) {
+            for (int p = 0; p < tilePixels; ++p)
+                samplePixel(p, targetSpp - estimates[p].n);
+        } else {
+            // The tile has targetSpp - previousSpp samples per pixel to spend.
+            // Every pixel gets minSpp, then in each round the pixels above the
+            // error threshold double their sample count, noisiest first, until
+            // they are all below it or the budget is gone. Converged pixels leave
+            // their share to the noisy ones, up to maxSpp each. Doubling keeps the
+            // sample counts at powers of two, where the Sobol and PMJ prefixes are
+            // best stratified.
+            int minSpp = std::min(targetSpp, std::max(2, adaptiveMinSpp));
+            int maxSpp = 8 * targetSpp;
+            int64_t budget = int64_t(targetSpp - previousSpp) * tilePixels;
+            for (int p = 0; p < tilePixels; ++p) {
+                int count = std::max(0, minSpp - estimates[p].n);
+                samplePixel(p, count);
+                budget -= count;
+            }
+            std::vector<std::pair<float, int>> noisy;
+            while (budget > 0) {
+                noisy.clear();
+                for (int p = 0; p < tilePixels; ++p) {
+                    float error = estimates[p].relativeError();
+                    if (error > adaptiveThreshold && estimates[p].n < maxSpp)
+                        noisy.emplace_back(error, p);
+                }
+                if (noisy.empty())
+                    break;
+                std::sort(noisy.begin(), noisy.end(), [](auto& a, auto& b) { return a.first > b.first; });
+                for (auto& [error, p] : noisy) {
+                    int count = std::min<int64_t>({estimates[p].n, maxSpp - estimates[p].n, budget});
+                    if (count <= 0)
+                        break;
+                    samplePixel(p, count);
+                    budget -= count;
+                }
+            }
         }
-        UpdateProgress(j / (float)scene.height);
-    }
-    UpdateProgress(1.f);
 
-    // save frame buffer to file
-    FILE* fp = fopen("binary.ppm", "wb");
-    (void)fprintf(fp, "P6\n%d %d\n255\n", scene.width, scene.height);
-    for (auto i = 0; i < scene.height * scene.width; ++i) {
-        static unsigned char color[3];
-        color[0] = (unsigned char)(255 * std::pow(clamp(0, 1, framebuffer[i].x), 0.6f));
-        color[1] = (unsigned char)(255 * std::pow(clamp(0, 1, framebuffer[i].y), 0.6f));
-        color[2] = (unsigned char)(255 * std::pow(clamp(0, 1, framebuffer[i].z), 0.6f));
-        fwrite(color, 1, 3, fp);
+        for (int j = tile.y0; j < tile.y1; ++j) {
+            for (int i = tile.x0; i < tile.x1; ++i) {
+                const PixelEstimate& e = estimates[(j - tile.y0) * tileWidth + (i - tile.x0)];
+                framebuffer[j * scene.width + i] = e.sum / e.n;
+            }
+        }
+        // only progressive passes come back to a tile, otherwise its G-buffer is done
+        if (!progressive) {
+            std::vector<Ray>().swap(primaryRays);
+            std::vector<Intersection>().swap(primaryHits);
+        }
+    };
+
+    const std::string output = "binary.ppm";
+    if (!progressive) {
+        parallel_for(0, tiles.size(), 1, [&](int64_t t) {
+            renderTile(t, 0, spp);
+            std::lock_guard<std::mutex> lock(progressMutex);
+            UpdateProgress(++tilesDone / (float)tiles.size());
+        });
+        UpdateProgress(1.f);
+        std::cout << "\n";
+        if (!writeImage(output, framebuffer, scene.width, scene.height))
+            printf("Could not write %s\n", output.c_str());
+    } else {
+        // The first pass always runs to the end, so there is an image whatever
+        // the limit. Later passes start only if the time per sample of the
+        // previous one says they fit, and are shortened to what fits; a tile
+        // that would still start past the deadline is skipped and keeps the
+        // samples of the passes before.
+        double secondsPerSpp = 0;
+        int completeSpp = 0;
+        for (int pass = 0; completeSpp < spp; ++pass) {
+            int targetSpp = std::min(spp, std::max(1, 2 * completeSpp));
+            if (pass > 0 && timeLimit > 0) {
+                double remaining = timeLimit - elapsed();
+                int affordable = secondsPerSpp > 0 ? int(std::min(remaining / secondsPerSpp, double(spp))) : spp;
+                targetSpp = std::min(targetSpp, completeSpp + affordable);
+                if (targetSpp <= completeSpp)
+                    break;
+            }
+
+            double passStart = elapsed();
+            std::atomic<size_t> skipped{0};
+            parallel_for(0, tiles.size(), 1, [&](int64_t t) {
+                if (pass > 0 && timeLimit > 0 && elapsed() > timeLimit) {
+                    ++skipped;
+                    return;
+                }
+                renderTile(t, completeSpp, targetSpp);
+            });
+            double passEnd = elapsed();
+            secondsPerSpp = (passEnd - passStart) / (targetSpp - completeSpp);
+
+            bool saved = writeImage(output, framebuffer, scene.width, scene.height);
+            printf("Pass %d: %d spp%s, %.2f s%s\n", pass + 1, targetSpp,
+                   skipped ? " (cut short at the time limit)" : "", passEnd, saved ? "" : ", could not write image");
+            if (skipped)
+                break;
+            completeSpp = targetSpp;
+        }
     }
-    fclose(fp);
+
+    int64_t samplesTaken = 0;
+    for (const TileState& state : states)
+        for (const PixelEstimate& e : state.estimates)
+            samplesTaken += e.n;
+    printf("Achieved %.1f spp on average in %.2f s (target %d spp", samplesTaken / double(scene.width * scene.height),
+           elapsed(), spp);
+    if (adaptive)
+        printf(", adaptive threshold %g", adaptiveThreshold);
+    printf(")\n");
 }
@@ -1,8 +1,36 @@
 #include "Scene.hpp"
+#include "Sampler.hpp"
 
 #pragma once
+
+// Order in which image tiles are handed out to the render workers.
+// MORTON keeps consecutive tiles spatially close (better cache reuse of BVH
+// nodes), SPIRAL starts from the image center so the interesting part shows up first.
+enum class TileOrder { SCANLINE, MORTON, SPIRAL };
+
 class Renderer
 {
 public:
+    int spp = 512;
+    int tileSize = 16;
+    // the camera rays of a pixel go through primaryStrata x primaryStrata sub-pixel strata,
+    // jittered if there are several and through the pixel center otherwise; they are
+    // traced once per render and cached
+    int primaryStrata = 1;
+    TileOrder tileOrder = TileOrder::MORTON;
+    // where the paths get their random numbers from; the seed decorrelates renders
+    SamplerType samplerType = SamplerType::SOBOL;
+    uint32_t seed = 0;
+    // adaptive sampling if > 0: pixels stop once the standard error of their mean
+    // luminance is below this fraction of it, and spp becomes the average budget
+    // of a tile; every pixel takes at least adaptiveMinSpp and at most 8 x spp samples
+    float adaptiveThreshold = 0;
+    int adaptiveMinSpp = 16;
+    // render in passes of doubling sample counts up to spp, saving the image
+    // after each; with timeLimit > 0 (seconds from the start of Render) the
+    // last pass is cut to what fits before the limit
+    bool progressive = false;
+    double timeLimit = 0;
+
     void Render(const Scene& scene);
 };
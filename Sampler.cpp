@@ -0,0 +1,408 @@
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <random>
+#include <vector>
+#include "Sampler.hpp"
+
+namespace
+{
+    // largest float below 1
+    const float oneMinusEpsilon = 0x1.fffffep-1;
+
+    float toUnitFloat(uint32_t bits) { return std::min(bits * 0x1p-32f, oneMinusEpsilon); }
+
+    // the top 23 bits as the mantissa of a float in [1, 2), minus 1: [0, 1) without
+    // a multiply or a clamp
+    float mantissaFloat(uint32_t bits)
+    {
+        uint32_t f = 0x3f800000u | (bits >> 9);
+        float v;
+        std::memcpy(&v, &f, sizeof(v));
+        return v - 1.0f;
+    }
+
+    uint32_t reverseBits(uint32_t x)
+    {
+        x = (x << 16) | (x >> 16);
+        x = ((x & 0x00ff00ff) << 8) | ((x & 0xff00ff00) >> 8);
+        x = ((x & 0x0f0f0f0f) << 4) | ((x & 0xf0f0f0f0) >> 4);
+        x = ((x & 0x33333333) << 2) | ((x & 0xcccccccc) >> 2);
+        x = ((x & 0x55555555) << 1) | ((x & 0xaaaaaaaa) >> 1);
+        return x;
+    }
+
+    // Owen scrambling of the bits of x: every bit is flipped depending on a hash
+    // of the bits above it (Laine-Karras permutation on the reversed bits, Burley 2020)
+    uint32_t owenScramble(uint32_t x, uint32_t seed)
+    {
+        x = reverseBits(x);
+        x += seed;
+        x ^= x * 0x6c50b47cu;
+        x ^= x * 0xb82f1e52u;
+        x ^= x * 0xc7afe638u;
+        x ^= x * 0x8d22f6e6u;
+        return reverseBits(x);
+    }
+
+    // first two dimensions of the Sobol sequence, together a (0,2) sequence in base 2
+    uint32_t sobol0(uint32_t index) { return reverseBits(index); }
+    uint32_t sobol1(uint32_t index)
+    {
+        uint32_t result = 0;
+        for (uint32_t v = 1u << 31; index; index >>= 1, v ^= v >> 1)
+            if (index & 1)
+                result ^= v;
+        return result;
+    }
+
+    // Progressive multi-jittered (0,2) sequence with count points (a power of two)
+    // as 32-bit fixed point coordinates. Every doubling puts one new point into the
+    // cell of each existing one: diagonally opposite when the count is a power of
+    // four, in one of the two free sub-cells otherwise. Inside the sub-cell the
+    // point goes to a random position whose elementary intervals of all shapes
+    // (2^a x 2^(m-a) for 2^m points) are still free.
+    std::vector<std::pair<uint32_t, uint32_t>> generatePMJ02(uint32_t count, std::mt19937& rng)
+    {
+        std::vector<std::pair<uint32_t, uint32_t>> points;
+        points.reserve(count);
+        points.emplace_back(rng(), rng());
+
+        std::vector<std::vector<bool>> occupied;
+        std::vector<bool> flipX;
+        std::vector<uint32_t> freeX, freeY;
+        for (uint32_t n = 1; n < count; n *= 2) {
+            int m = 0;
+            while ((1u << m) < 2 * n)
+                ++m;
+            auto stratum = [m](uint32_t x, uint32_t y, int a) {
+                uint32_t xs = a ? x >> (32 - a) : 0, ys = m - a ? y >> (32 - (m - a)) : 0;
+                return (xs << (m - a)) | ys;
+            };
+            occupied.assign(m + 1, std::vector<bool>(2 * n, false));
+            auto mark = [&](uint32_t x, uint32_t y) {
+                for (int a = 0; a <= m; ++a)
+                    occupied[a][stratum(x, y, a)] = true;
+            };
+            for (auto& p : points)
+                mark(p.first, p.second);
+
+            // n = 4^k: cells of a 2^k x 2^k grid hold one point, else a 2^k x 2^k
+            // grid with two points per cell in diagonally opposite sub-cells
+            int k = (m - 1) / 2;
+            bool powerOfFour = (m - 1) % 2 == 0;
+            if (!powerOfFour) {
+                flipX.resize(n / 2);
+                for (auto&& f : flipX)
+                    f = rng() & 1;
+            }
+
+            for (uint32_t s = 0; s < n; ++s) {
+                uint32_t x = points[s].first, y = points[s].second;
+                // the sub-cell of the old point: top k + 1 bits of each coordinate
+                uint32_t cellX = x >> (31 - k), cellY = y >> (31 - k);
+                if (powerOfFour) {
+                    cellX ^= 1;
+                    cellY ^= 1;
+                } else if (flipX[s % (n / 2)]) {
+                    cellX ^= 1;
+                } else {
+                    cellY ^= 1;
+                }
+
+                // finest x and y strata (top m bits) inside the sub-cell that are still
+                // free, combinations tried in random order
+                int freeBits = m - (k + 1);
+                freeX.clear();
+                freeY.clear();
+                for (uint32_t c = 0; c < (1u << freeBits); ++c) {
+                    if (!occupied[m][(cellX << freeBits) | c])
+                        freeX.push_back((cellX << freeBits) | c);
+                    if (!occupied[0][(cellY << freeBits) | c])
+                        freeY.push_back((cellY << freeBits) | c);
+                }
+                std::shuffle(freeX.begin(), freeX.end(), rng);
+                std::shuffle(freeY.begin(), freeY.end(), rng);
+                uint32_t newX = 0, newY = 0;
+                bool found = false;
+                for (size_t i = 0; i < freeX.size() && !found; ++i) {
+                    for (size_t j = 0; j < freeY.size() && !found; ++j) {
+                        // jitter inside the finest stratum
+                        newX = (freeX[i] << (32 - m)) | (rng() >> m);
+                        newY = (freeY[j] << (32 - m)) | (rng() >> m);
+                        found = true;
+                        for (int a = 1; a < m && found; ++a)
+                            found = !occupied[a][stratum(newX, newY, a)];
+                    }
+                }
+                // no combination left: keep the last one, the point is then only jittered
+                mark(newX, newY);
+                points.emplace_back(newX, newY);
+            }
+        }
+        return points;
+    }
+
+    struct PMJTables
+    {
+        static constexpr uint32_t numTables = 16, tableSize = 4096;
+        std::vector<std::pair<uint32_t, uint32_t>> tables[numTables];
+
+        PMJTables()
+        {
+            std::mt19937 rng(20180816);
+            for (auto& table : tables)
+                table = generatePMJ02(tableSize, rng);
+        }
+
+        static const PMJTables& get()
+        {
+            static PMJTables instance;
+            return instance;
+        }
+    };
+
+    // Void-and-cluster blue-noise mask (Ulichney 1993): every pixel gets a rank,
+    // the pixels of rank below r form an evenly spread pattern for every r.
+    struct BlueNoiseMask
+    {
+        static constexpr int size = 64;
+        float values[size * size];
+
+        BlueNoiseMask()
+        {
+            const int n = size * size;
+            const float sigma = 1.5f;
+            // toroidal Gaussian energy of a pixel at offset (dx, dy)
+            std::vector<float> kernel(n);
+            for (int dy = 0; dy < size; ++dy) {
+                for (int dx = 0; dx < size; ++dx) {
+                    int ex = std::min(dx, size - dx), ey = std::min(dy, size - dy);
+                    kernel[dy * size + dx] = std::exp(-(ex * ex + ey * ey) / (2 * sigma * sigma));
+                }
+            }
+            std::vector<char> pattern(n, 0);
+            std::vector<float> energy(n, 0);
+            auto toggle = [&](std::vector<char>& pat, std::vector<float>& en, int p) {
+                float sign = pat[p] ? -1.0f : 1.0f;
+                pat[p] = !pat[p];
+                int px = p % size, py = p / size;
+                for (int y = 0; y < size; ++y) {
+                    const float* row = &kernel[((y - py + size) % size) * size];
+                    for (int x = 0; x < size; ++x)
+                        en[y * size + x] += sign * row[(x - px + size) % size];
+                }
+            };
+            // tightest cluster: the set pixel of highest energy; largest void: the free one of lowest
+            auto extreme = [&](const std::vector<char>& pat, const std::vector<float>& en, bool set) {
+                int best = -1;
+                for (int p = 0; p < n; ++p)
+                    if (bool(pat[p]) == set &&
+                        (best < 0 || (set ? en[p] > en[best] : en[p] < en[best])))
+                        best = p;
+                return best;
+            };
+
+            // initial pattern: a tenth of the pixels, relaxed until stable
+            std::mt19937 rng(1993);
+            int ones = n / 10;
+            for (int placed = 0; placed < ones;) {
+                int p = rng() % n;
+                if (!pattern[p]) {
+                    toggle(pattern, energy, p);
+                    ++placed;
+                }
+            }
+            while (true) {
+                int cluster = extreme(pattern, energy, true);
+                toggle(pattern, energy, cluster);
+                int gap = extreme(pattern, energy, false);
+                toggle(pattern, energy, gap);
+                if (gap == cluster)
+                    break;
+            }
+
+            std::vector<int> rank(n);
+            // ranks below the initial pattern: remove clusters one by one
+            std::vector<char> pat = pattern;
+            std::vector<float> en = energy;
+            for (int r = ones - 1; r >= 0; --r) {
+                int p = extreme(pat, en, true);
+                toggle(pat, en, p);
+                rank[p] = r;
+            }
+            // ranks above it: fill voids one by one
+            for (int r = ones; r < n; ++r) {
+                int p = extreme(pattern, energy, false);
+                toggle(pattern, energy, p);
+                rank[p] = r;
+            }
+            for (int p = 0; p < n; ++p)
+                values[p] = (rank[p] + 0.5f) / n;
+        }
+
+        static const BlueNoiseMask& get()
+        {
+            static BlueNoiseMask instance;
+            return instance;
+        }
+
+        float at(int x, int y) const { return values[(y & (size - 1)) * size + (x & (size - 1))]; }
+    };
+
+    // Counter-based: every value is a hash of (seed, pixel, sample index, dimension),
+    // so there is no generator state and the values do not depend on which thread
+    // renders the pixel.
+    class RandomSampler : public Sampler
+    {
+    public:
+        explicit RandomSampler(uint32_t seed) : seed(seed) {}
+
+        float get1D() override { return mantissaFloat(uint32_t(next(1))); }
+
+        Vector2f get2D() override
+        {
+            uint64_t bits = next(2);
+            return Vector2f(mantissaFloat(uint32_t(bits)), mantissaFloat(uint32_t(bits >> 32)));
+        }
+
+        std::unique_ptr<Sampler> clone() const override { return std::make_unique<RandomSampler>(seed); }
+
+    protected:
+        void startPixel() override
+        {
+            uint64_t pixelSeed = hashValues(seed, (uint64_t(pixelY) << 32) | uint32_t(pixelX));
+            sampleSeed = mixBits((pixelSeed << 32) | uint32_t(sampleIndex));
+        }
+
+        // 64 bits for the current dimension, then skip count dimensions
+        uint64_t next(uint32_t count)
+        {
+            uint64_t bits = mixBits(sampleSeed ^ mixBits(dimension));
+            dimension += count;
+            return bits;
+        }
+
+        uint32_t seed;
+        uint64_t sampleSeed = 0;
+    };
+
+    class SobolSampler : public Sampler
+    {
+    public:
+        explicit SobolSampler(uint32_t seed) : seed(seed) {}
+
+        float get1D() override
+        {
+            uint32_t h = hashValues(pixelSeed, dimension++);
+            uint32_t index = owenScramble(sampleIndex, h);
+            return toUnitFloat(owenScramble(sobol0(index), hashValues(h, 1)));
+        }
+
+        Vector2f get2D() override
+        {
+            uint32_t h = hashValues(pixelSeed, dimension);
+            dimension += 2;
+            // the pair shares one shuffled index, which keeps it a (0,2) sequence
+            uint32_t index = owenScramble(sampleIndex, h);
+            return Vector2f(toUnitFloat(owenScramble(sobol0(index), hashValues(h, 1))),
+                            toUnitFloat(owenScramble(sobol1(index), hashValues(h, 2))));
+        }
+
+        std::unique_ptr<Sampler> clone() const override { return std::make_unique<SobolSampler>(seed); }
+
+    protected:
+        void startPixel() override { pixelSeed = hashValues(seed, (uint64_t(pixelY) << 32) | uint32_t(pixelX)); }
+
+        uint32_t seed;
+        uint32_t pixelSeed = 0;
+    };
+
+    class PMJSampler : public Sampler
+    {
+    public:
+        explicit PMJSampler(uint32_t seed) : seed(seed), tables(PMJTables::get()) {}
+
+        float get1D() override { return toUnitFloat(point(dimension++).first); }
+
+        Vector2f get2D() override
+        {
+            auto p = point(dimension);
+            dimension += 2;
+            return Vector2f(toUnitFloat(p.first), toUnitFloat(p.second));
+        }
+
+        std::unique_ptr<Sampler> clone() const override { return std::make_unique<PMJSampler>(seed); }
+
+    protected:
+        void startPixel() override { pixelSeed = hashValues(seed, (uint64_t(pixelY) << 32) | uint32_t(pixelX)); }
+
+        // a table picked by pixel, dimension and the sample index beyond the table
+        // size. Dimensions that share a table get their own order of its points
+        // (scrambling the index bits keeps aligned power-of-two blocks together,
+        // and those are stratified), and Owen scrambling of the coordinates keeps
+        // the stratification of the table
+        std::pair<uint32_t, uint32_t> point(uint32_t dim) const
+        {
+            uint32_t wrap = sampleIndex / PMJTables::tableSize;
+            uint32_t h = hashValues(pixelSeed, (uint64_t(wrap) << 32) | dim);
+            uint32_t index = owenScramble(sampleIndex % PMJTables::tableSize, hashValues(h, 3)) % PMJTables::tableSize;
+            auto& p = tables.tables[h % PMJTables::numTables][index];
+            return {owenScramble(p.first, hashValues(h, 1)), owenScramble(p.second, hashValues(h, 2))};
+        }
+
+        uint32_t seed;
+        uint32_t pixelSeed = 0;
+        const PMJTables& tables;
+    };
+
+    class BlueNoiseSampler : public Sampler
+    {
+    public:
+        explicit BlueNoiseSampler(uint32_t seed) : seed(seed), mask(BlueNoiseMask::get()) {}
+
+        float get1D() override
+        {
+            uint32_t h = hashValues(seed, dimension++);
+            uint32_t index = owenScramble(sampleIndex, h);
+            return shift(toUnitFloat(owenScramble(sobol0(index), hashValues(h, 1))), h);
+        }
+
+        Vector2f get2D() override
+        {
+            uint32_t h = hashValues(seed, dimension);
+            dimension += 2;
+            uint32_t index = owenScramble(sampleIndex, h);
+            return Vector2f(shift(toUnitFloat(owenScramble(sobol0(index), hashValues(h, 1))), hashValues(h, 3)),
+                            shift(toUnitFloat(owenScramble(sobol1(index), hashValues(h, 2))), hashValues(h, 4)));
+        }
+
+        std::unique_ptr<Sampler> clone() const override { return std::make_unique<BlueNoiseSampler>(seed); }
+
+    private:
+        // toroidal shift by the mask value of this pixel, the mask is offset per dimension
+        float shift(float u, uint32_t h) const
+        {
+            float v = u + mask.at(pixelX + (h & 0xffff), pixelY + (h >> 16));
+            return std::min(v < 1 ? v : v - 1, oneMinusEpsilon);
+        }
+
+        uint32_t seed;
+        const BlueNoiseMask& mask;
+    };
+}
+
+std::unique_ptr<Sampler> Sampler::create(SamplerType type, uint32_t seed)
+{
+    switch (type) {
+    case SamplerType::SOBOL:
+        return std::make_unique<SobolSampler>(seed);
+    case SamplerType::PMJ:
+        return std::make_unique<PMJSampler>(seed);
+    case SamplerType::BLUE_NOISE:
+        return std::make_unique<BlueNoiseSampler>(seed);
+    case SamplerType::RANDOM:
+    default:
+        return std::make_unique<RandomSampler>(seed);
+    }
+}
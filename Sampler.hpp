@@ -0,0 +1,71 @@
+#pragma once
+#include <cstdint>
+#include <memory>
+#include "Vector.hpp"
+
+// Source of the sample values of a path. The renderer starts every sample of a
+// pixel with startPixelSample(); after that every get1D() / get2D() call takes
+// the next dimension(s) of that sample, so the n-th number drawn along a path is
+// stratified against the n-th number of the other samples of the pixel.
+//
+//  RANDOM      uniform numbers hashed from (seed, pixel, sample, dimension)
+//  SOBOL       Owen-scrambled Sobol points; every pair of dimensions is a (0,2)
+//              sequence with its own scrambled sample order (Burley 2020)
+//  PMJ         progressive multi-jittered (0,2) sequences (Christensen et al.
+//              2018) from tables built on first use, Owen-scrambled per pixel
+//  BLUE_NOISE  one Sobol sequence for all pixels, shifted per pixel and
+//              dimension by a blue-noise mask, so the remaining error is spread
+//              out in screen space as high-frequency noise
+//
+// The values depend only on the seed, the pixel, the sample index and the
+// dimension, so a render is the same whatever thread runs a tile.
+enum class SamplerType { RANDOM, SOBOL, PMJ, BLUE_NOISE };
+
+class Sampler
+{
+public:
+    virtual ~Sampler() {}
+
+    // begin sample sampleIndex of pixel (x, y) at the given dimension; the ones
+    // before it are left to whoever drew them, e.g. the cached camera rays
+    void startPixelSample(int x, int y, int sampleIndex, uint32_t dimension = 0)
+    {
+        pixelX = x;
+        pixelY = y;
+        this->sampleIndex = sampleIndex;
+        this->dimension = dimension;
+        startPixel();
+    }
+
+    virtual float get1D() = 0;
+    virtual Vector2f get2D() = 0;
+
+    // an independent sampler of the same kind, e.g. for another thread
+    virtual std::unique_ptr<Sampler> clone() const = 0;
+
+    static std::unique_ptr<Sampler> create(SamplerType type, uint32_t seed = 0);
+
+protected:
+    // called by startPixelSample() once the pixel and sample index are set
+    virtual void startPixel() {}
+
+    int pixelX = 0, pixelY = 0;
+    int sampleIndex = 0;
+    uint32_t dimension = 0;
+};
+
+// well mixed bits of v (murmur3 finalizer)
+inline uint64_t mixBits(uint64_t v)
+{
+    v ^= v >> 33;
+    v *= 0xff51afd7ed558ccdull;
+    v ^= v >> 33;
+    v *= 0xc4ceb9fe1a85ec53ull;
+    v ^= v >> 33;
+    return v;
+}
+
+inline uint32_t hashValues(uint64_t a, uint64_t b)
+{
+    return uint32_t(mixBits(a * 0x9e3779b97f4a7c15ull ^ mixBits(b)));
+}
@@ -1,9 +1,72 @@
+#include <chrono>
+#include <unordered_set>
 #include "Scene.hpp"
-
+#include "Triangle.hpp"
+#include "Instance.hpp"
+#include "TaskScheduler.hpp"
 
 void Scene::buildBVH() {
     printf(" - Generating BVH...\n\n");
-    this->bvh = new BVHAccel(objects, 1, BVHAccel::SplitMethod::NAIVE);
+    auto start = std::chrono::steady_clock::now();
+
+    delete this->bvh;
+    delete this->flattened;
+    this->flattened = nullptr;
+    if (bvhOptions.flatten) {
+        // merge the faces of all meshes into one mesh with per-face materials;
+        // instances (and spheres) remain single primitives with their own BVH
+        TriangleMesh merged;
+        std::vector<Object*> prims;
+        for (auto object : objects) {
+            if (auto mesh = dynamic_cast<Mesh*>(object)) {
+                merged.append(mesh->geometry);
+            } else {
+                object->buildBVH(bvhOptions);
+                prims.push_back(object);
+            }
+        }
+        if (merged.numFaces() > 0) {
+            this->flattened = new Mesh(std::move(merged));
+            this->flattened->buildBVH(bvhOptions);
+            prims.push_back(this->flattened);
+        }
+        this->bvh = new BVHAccel(prims, 1, bvhOptions.splitMethod);
+        // light hits are reported on the merged mesh, so its faces are the lights
+        lightBVH.build(prims);
+    } else {
+        // the per-mesh BVHs are independent of each other, build them concurrently.
+        // Each mesh is built once before any instance of it is visited: a worker
+        // waiting inside one mesh build helps with other tasks and must not pick up
+        // an instance that would wait for the same mesh.
+        std::vector<Mesh*> meshes;
+        std::unordered_set<Mesh*> seen;
+        for (auto object : objects) {
+            Mesh* mesh = dynamic_cast<Mesh*>(object);
+            if (auto instance = dynamic_cast<Instance*>(object))
+                mesh = instance->mesh;
+            if (mesh && seen.insert(mesh).second)
+                meshes.push_back(mesh);
+        }
+        parallel_for(0, meshes.size(), 1, [&](int64_t i) { meshes[i]->buildBVH(bvhOptions); });
+        parallel_for(0, objects.size(), 1, [this](int64_t i) { objects[i]->buildBVH(bvhOptions); });
+        this->bvh = new BVHAccel(objects, 1, bvhOptions.splitMethod);
+        lightBVH.build(objects);
+    }
+    this->bvh->setWide(bvhOptions.wide);
+
+    emitters.clear();
+    std::vector<float> emitterAreas;
+    for (auto object : objects) {
+        if (object->hasEmit()) {
+            emitters.push_back(object);
+            emitterAreas.push_back(object->getArea());
+        }
+    }
+    emitterTable.build(emitterAreas);
+
+    auto stop = std::chrono::steady_clock::now();
+    printf("Scene BVHs built in %.2f ms\n\n",
+           std::chrono::duration<double, std::milli>(stop - start).count());
 }
 
 Intersection Scene::intersect(const Ray &ray) const
@@ -11,32 +74,67 @@ Intersection Scene::intersect(const Ray &ray) const
     return this->bvh->Intersect(ray);
 }
 
-void Scene::sampleLight(Intersection &pos, float &pdf) const
+bool Scene::occluded(const Vector3f& origin, const Vector3f& target) const
 {
-    float emit_area_sum = 0;
-    for (uint32_t k = 0; k < objects.size(); ++k) {
-        if (objects[k]->hasEmit()){
-            emit_area_sum += objects[k]->getArea();
-        }
+    Vector3f d = target - origin;
+    float dist = d.norm();
+    Ray ray(origin, d / dist);
+    // stop just short of the target so the surface sampled there does not occlude itself
+    ray.t_max = dist * (1.0f - ShadowEpsilon);
+    return this->bvh->IntersectP(ray);
+}
+
+void Scene::sampleLight(const Vector3f &p, const Vector3f &n, Sampler &sampler, Intersection &pos, float &pdf) const
+{
+    // the same dimensions whatever light is picked and however it is picked, so
+    // the dimensions drawn after the light sample stay aligned across the samples
+    // of a pixel (see Material::sample)
+    Vector2f uLight = sampler.get2D();
+    Vector2f uFace = sampler.get2D();
+    Vector2f uPoint = sampler.get2D();
+    if (lightSampling == LightSampling::BVH) {
+        lightBVH.sample(p, n, uLight.x, uFace, uPoint, pos, pdf);
+        return;
     }
-    float p = get_random_float() * emit_area_sum;
-    emit_area_sum = 0;
-    for (uint32_t k = 0; k < objects.size(); ++k) {
-        if (objects[k]->hasEmit()){
-            emit_area_sum += objects[k]->getArea();
-            if (p <= emit_area_sum){
-                // sample from mesh triangle
-                // however in this case,
-                // if there are several light sources, the integral may not be correct
-                // because the denominator of the pdf only counts one light source's area
-                objects[k]->Sample(pos, pdf);
-                break;
-            }
-        }
+    if (emitterTable.empty()) {
+        pdf = 0;
+        return;
+    }
+    // pick an emitter by area, then a point on it; the pdf of the point with
+    // respect to the total emitting area is that of picking the emitter times
+    // the pdf of the point on it
+    size_t k = emitterTable.sample(uLight.x, uLight.y);
+    emitters[k]->Sample(pos, pdf, uFace, uPoint);
+    pdf *= float(emitters[k]->getArea() / emitterTable.total);
+}
+
+float Scene::lightPdf(const Vector3f &p, const Vector3f &n, const Intersection &light) const
+{
+    if (lightSampling == LightSampling::BVH) {
+        int64_t k = lightBVH.find(light.obj, light.face);
+        if (k < 0)
+            return 0;
+        const LightBVH::Light& l = lightBVH.lights[k];
+        float area = l.face >= 0 ? static_cast<Mesh*>(l.object)->geometry.faceArea(l.face) : l.object->getArea();
+        return lightBVH.pmf(p, n, k) / area;
     }
+    // every emitting point is equally likely
+    return emitterTable.empty() ? 0 : float(1 / emitterTable.total);
 }
 
-Vector3f Scene::castRay(const Ray &ray, const Intersection &intersection, int depth) const
+// weight of a sample drawn with pdf a against another technique with pdf b
+static float powerHeuristic(float a, float b)
+{
+    return a * a / (a * a + b * b);
+}
+
+// Direct light is estimated twice: with a point sampled on an emitter and with
+// the emitter found by the BSDF-sampled continuation ray. Both estimates are
+// combined with the power heuristic, so light sampling handles large and rough
+// reflections and BSDF sampling handles small lights in glossy ones. Emission is
+// only returned directly for rays leaving the camera; deeper rays that hit an
+// emitter are weighted by the caller.
+Vector3f Scene::castRay(const Ray &ray, const Intersection &intersection, int depth, Sampler &sampler) const
 {
     Material *m = intersection.m;
 
@@ -45,31 +143,44 @@ Vector3f Scene::castRay(const Ray &ray, const Intersection &intersection, int de
     }
     Vector3f hitPoint = intersection.coords;
     Vector3f N = intersection.normal;
+    Vector3f wo = -ray.direction;
     Intersection pos;
     float pdf_light;
-    
-    sampleLight(pos, pdf_light);
+
+    sampleLight(hitPoint, N, sampler, pos, pdf_light);
     Vector3f x = pos.coords;
     Vector3f wsOrig = x-hitPoint;
     Vector3f ws = wsOrig.normalized();
-    Vector3f wo = -ray.direction;
     Vector3f NN = pos.normal;
     Vector3f L_dir = 0.0f;
 
-    if((intersect(Ray(hitPoint, ws)).coords - x).norm2() < EPSILON){
-        L_dir = pos.emit * m->eval(wo, ws, N) * dotProduct(ws, N) * dotProduct(-ws, NN) / (wsOrig.norm2() * pdf_light);
+    float cosLight = dotProduct(-ws, NN);
+    if(pdf_light > 0 && cosLight > 0 && !occluded(hitPoint, x)){
+        // area to solid angle; the BSDF only finds the light if the path survives the roulette
+        float pdfLightSA = pdf_light * wsOrig.norm2() / cosLight;
+        float pdfBSDF = m->pdf(wo, ws, N) * RussianRoulette;
+        L_dir = pos.emit * m->eval(wo, ws, N) * dotProduct(ws, N) / pdfLightSA * powerHeuristic(pdfLightSA, pdfBSDF);
     }
 
     Vector3f L_indir = 0.0f;
-    if(get_random_float() < RussianRoulette){
-        Vector3f wi = m->sample(wo , N);
+    if(sampler.get1D() < RussianRoulette){
+        Vector3f wi = m->sample(wo , N, sampler);
+        float pdf = m->pdf(wo, wi, N);
         Ray ray2(hitPoint, wi);
         Intersection intersection2 = intersect(ray2);
-        if(intersection2.happened && !(intersection2.m->hasEmission())){
-            float pdf = std::max(m->pdf(wo, wi, N), EPSILON);
-            L_indir = castRay(ray2, intersection2, depth+1) * m->eval(wo, wi, N) * dotProduct(wi, N) / (pdf * RussianRoulette);
+        if(pdf > 0 && intersection2.happened){
+            Vector3f f = m->eval(wo, wi, N) * dotProduct(wi, N) / (pdf * RussianRoulette);
+            if(intersection2.m->hasEmission()){
+                Vector3f d = intersection2.coords - hitPoint;
+                float cos2 = dotProduct(-wi, intersection2.normal);
+                float pdfLightSA = cos2 > 0 ? lightPdf(hitPoint, N, intersection2) * d.norm2() / cos2 : 0;
+                L_indir = intersection2.m->getEmission() * f * powerHeuristic(pdf * RussianRoulette, pdfLightSA);
+            }
+            else{
+                L_indir = castRay(ray2, intersection2, depth+1, sampler) * f;
+            }
         }
     }
 
     return L_indir + L_dir;
-}
\ No newline at end of file
+}
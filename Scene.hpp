@@ -2,12 +2,23 @@
 
 #include <vector>
 #include "Vector.hpp"
+#include "AliasTable.hpp"
 #include "Object.hpp"
 #include "Light.hpp"
 #include "BVH.hpp"
+#include "LightBVH.hpp"
 #include "Ray.hpp"
 
 
+// how sampleLight() picks the emitter
+enum class LightSampling
+{
+    // proportional to emitting area, independent of the shading point
+    AREA,
+    // by estimated contribution at the shading point, through the light BVH
+    BVH
+};
+
 class Scene
 {
 public:
@@ -17,6 +28,10 @@ public:
     Vector3f backgroundColor = Vector3f(0.235294, 0.67451, 0.843137);
     int maxDepth = 1;
     float RussianRoulette = 0.8;
+    // shadow rays end this fraction of their length before the light sample
+    float ShadowEpsilon = 1e-4;
+    BVHBuildOptions bvhOptions;
+    LightSampling lightSampling = LightSampling::BVH;
     std::vector<Object*> objects;
     std::vector<std::unique_ptr<Light> > lights;
 
@@ -29,8 +44,21 @@ public:
     const std::vector<std::unique_ptr<Light> >& get_lights() const { return lights; }
 
     Intersection intersect(const Ray& ray) const;
-    BVHAccel *bvh;
+    // is anything blocking the segment between origin and target?
+    bool occluded(const Vector3f& origin, const Vector3f& target) const;
+    BVHAccel *bvh = nullptr;
+    // with bvhOptions.flatten: a mesh holding a copy of the faces of all meshes
+    Object *flattened = nullptr;
+    // emitting objects, sampled by area through emitterTable; filled by buildBVH()
+    std::vector<Object*> emitters;
+    AliasTable emitterTable;
+    // emissive faces and objects for LightSampling::BVH; filled by buildBVH()
+    LightBVH lightBVH;
     void buildBVH();
-    Vector3f castRay(const Ray &ray, const Intersection &intersection, int depth) const;
-    void sampleLight(Intersection &pos, float &pdf) const;
+    Vector3f castRay(const Ray &ray, const Intersection &intersection, int depth, Sampler &sampler) const;
+    // pick a point on an emitter for the shading point p with normal n; pdf is
+    // with respect to area, 0 if there is nothing to sample
+    void sampleLight(const Vector3f &p, const Vector3f &n, Sampler &sampler, Intersection &pos, float &pdf) const;
+    // area pdf of sampleLight() returning the emitting point hit by light
+    float lightPdf(const Vector3f &p, const Vector3f &n, const Intersection &light) const;
 };
\ No newline at end of file
@@ -0,0 +1,69 @@
+#pragma once
+#include <chrono>
+#include <cstdlib>
+#include <deque>
+#include <memory>
+#include <string>
+#include "Scene.hpp"
+#include "Triangle.hpp"
+#include "TaskScheduler.hpp"
+
+// Loads the meshes of a scene concurrently. Every load() starts a task that
+// parses the OBJ file (or maps its cache) and builds the mesh BVH right away, so
+// the scene is ready after about the time of its largest asset instead of the
+// sum of all of them. wait() adds the meshes to the scene in the order they were
+// requested; the scene BVH is built afterwards by Scene::buildBVH(), which only
+// has the top level left to do.
+class SceneLoader
+{
+public:
+    // the loader owns the meshes, it has to outlive the scene's use of them
+    explicit SceneLoader(Scene& scene) : scene(scene), start(std::chrono::steady_clock::now()) {}
+    ~SceneLoader() { tasks.wait(); }
+
+    // queue filename, returns the index of the mesh for mesh()
+    size_t load(const std::string& filename, Material* material)
+    {
+        // deque slots stay put while later loads are queued
+        meshes.emplace_back();
+        std::unique_ptr<Mesh>* slot = &meshes.back();
+        BVHBuildOptions options = scene.bvhOptions;
+        tasks.run([slot, filename, material, options] {
+            auto mesh = std::make_unique<Mesh>(filename, material);
+            // a flattened scene BVH does not use the per-mesh BVHs
+            if (!options.flatten && mesh->loadError.empty())
+                mesh->buildBVH(options);
+            *slot = std::move(mesh);
+        });
+        return meshes.size() - 1;
+    }
+
+    // wait for all queued loads and add the new meshes to the scene; a mesh that
+    // failed to load ends the program, the scene would miss an object (or sample
+    // an emitter without faces)
+    void wait()
+    {
+        tasks.wait();
+        for (size_t i = added; i < meshes.size(); ++i) {
+            if (!meshes[i]->loadError.empty()) {
+                printf("Cannot load mesh: %s\n", meshes[i]->loadError.c_str());
+                std::exit(EXIT_FAILURE);
+            }
+        }
+        for (; added < meshes.size(); ++added)
+            scene.Add(meshes[added].get());
+        auto stop = std::chrono::steady_clock::now();
+        printf("Loaded %zu meshes in %.2f ms\n\n", meshes.size(),
+               std::chrono::duration<double, std::milli>(stop - start).count());
+    }
+
+    // only valid after wait()
+    Mesh& mesh(size_t index) { return *meshes[index]; }
+
+private:
+    Scene& scene;
+    std::chrono::steady_clock::time_point start;
+    std::deque<std::unique_ptr<Mesh>> meshes;
+    size_t added = 0;
+    TaskGroup tasks;
+};
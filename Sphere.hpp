@@ -34,12 +34,23 @@ public:
 
     }
 
+    bool intersectP(const Ray& ray){
+        Vector3f L = ray.origin - center;
+        float a = dotProduct(ray.direction, ray.direction);
+        float b = 2 * dotProduct(ray.direction, L);
+        float c = dotProduct(L, L) - radius2;
+        float t0, t1;
+        if (!solveQuadratic(a, b, c, t0, t1)) return false;
+        if (t0 < 0) t0 = t1;
+        return t0 >= 0 && t0 < ray.t_max;
+    }
+
     Bounds3 getBounds(){
         return Bounds3(Vector3f(center.x-radius, center.y-radius, center.z-radius),
                        Vector3f(center.x+radius, center.y+radius, center.z+radius));
     }
-    void Sample(Intersection &pos, float &pdf){
-        float theta = 2.0 * M_PI * get_random_float(), phi = M_PI * get_random_float();
+    void Sample(Intersection &pos, float &pdf, const Vector2f &, const Vector2f &u){
+        float theta = 2.0 * M_PI * u.x, phi = M_PI * u.y;
         Vector3f dir(std::cos(phi), std::sin(phi)*std::cos(theta), std::sin(phi)*std::sin(theta));
         pos.coords = center + radius * dir;
         pos.normal = dir;
@@ -0,0 +1,455 @@
+#pragma once
+
+#include <atomic>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+// A unit of work run by the TaskScheduler. Tasks are heap allocated by the
+// spawner and deleted by whichever worker executes them.
+struct Task
+{
+    virtual ~Task() = default;
+    virtual void execute() = 0;
+};
+
+// Chase-Lev work stealing deque, following the C11 formulation of
+// Le, Pop, Cohen and Zappa Nardelli, "Correct and Efficient Work-Stealing for
+// Weak Memory Models" (PPoPP 2013).
+// push/pop may only be called by the owning worker, steal by anyone.
+class WorkStealingDeque
+{
+    struct Array
+    {
+        int64_t capacity, mask;
+        std::unique_ptr<std::atomic<Task*>[]> buffer;
+
+        explicit Array(int64_t c) : capacity(c), mask(c - 1), buffer(new std::atomic<Task*>[c]) {}
+        Task* get(int64_t i) const { return buffer[i & mask].load(std::memory_order_relaxed); }
+        void put(int64_t i, Task* t) { buffer[i & mask].store(t, std::memory_order_relaxed); }
+    };
+
+    alignas(64) std::atomic<int64_t> top{0};
+    alignas(64) std::atomic<int64_t> bottom{0};
+    std::atomic<Array*> array;
+    // arrays replaced by grow() may still be read by a concurrent thief,
+    // so they are only released together with the deque
+    std::vector<std::unique_ptr<Array>> retired;
+
+public:
+    explicit WorkStealingDeque(int64_t capacity = 256)
+    {
+        retired.emplace_back(new Array(capacity));
+        array.store(retired.back().get(), std::memory_order_relaxed);
+    }
+
+    void push(Task* task)
+    {
+        int64_t b = bottom.load(std::memory_order_relaxed);
+        int64_t t = top.load(std::memory_order_acquire);
+        Array* a = array.load(std::memory_order_relaxed);
+        if (b - t > a->capacity - 1) {
+            Array* bigger = new Array(a->capacity * 2);
+            for (int64_t i = t; i < b; ++i)
+                bigger->put(i, a->get(i));
+            retired.emplace_back(bigger);
+            array.store(bigger, std::memory_order_release);
+            a = bigger;
+        }
+        a->put(b, task);
+        std::atomic_thread_fence(std::memory_order_release);
+        bottom.store(b + 1, std::memory_order_relaxed);
+    }
+
+    Task* pop()
+    {
+        int64_t b = bottom.load(std::memory_order_relaxed) - 1;
+        Array* a = array.load(std::memory_order_relaxed);
+        bottom.store(b, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        int64_t t = top.load(std::memory_order_relaxed);
+        if (t > b) {
+            // deque was empty
+            bottom.store(b + 1, std::memory_order_relaxed);
+            return nullptr;
+        }
+        Task* task = a->get(b);
+        if (t == b) {
+            // last element, race against thieves for it
+            if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst,
+                                             std::memory_order_relaxed))
+                task = nullptr;
+            bottom.store(b + 1, std::memory_order_relaxed);
+        }
+        return task;
+    }
+
+    Task* steal()
+    {
+        int64_t t = top.load(std::memory_order_acquire);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        int64_t b = bottom.load(std::memory_order_acquire);
+        if (t >= b)
+            return nullptr;
+        Array* a = array.load(std::memory_order_acquire);
+        Task* task = a->get(t);
+        if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst,
+                                         std::memory_order_relaxed))
+            return nullptr;
+        return task;
+    }
+};
+
+// Work stealing task runtime shared by the renderer, the BVH builder and the
+// mesh loaders. Every worker owns a Chase-Lev deque: it pushes and pops its own
+// tasks LIFO and steals FIFO from a random victim when it runs dry. The thread
+// that creates the scheduler becomes worker 0, any other thread submits through
+// a small locked injection queue.
+//
+// With pinThreads every worker is bound to one of the cores the process may run
+// on. Memory a worker touches first (its deque, its thread_local rng, the tile
+// buffers it allocates) is then placed on that core's NUMA node by the kernel's
+// first-touch policy.
+class TaskScheduler
+{
+public:
+    explicit TaskScheduler(size_t numThreads, bool pinThreads = false);
+    ~TaskScheduler();
+
+    size_t size() const { return queues.size(); }
+
+    // index of the calling thread inside this scheduler, -1 for foreign threads
+    int workerIndex() const { return tls().owner == this ? tls().index : -1; }
+
+    void spawn(Task* task);
+    // run a single pending task if one can be found, used by waiting threads to help out
+    bool runOne();
+
+    // thread count used when none is given: RT_THREADS if set, else the number of hardware threads
+    static size_t defaultThreadCount();
+
+    // (re)create the global scheduler, must not be called while tasks are in flight
+    static void init(size_t numThreads, bool pinThreads = false);
+    static TaskScheduler& get();
+
+private:
+    struct ThreadState
+    {
+        const TaskScheduler* owner = nullptr;
+        int index = -1;
+        uint32_t rng = 0x9e3779b9u;
+    };
+    static ThreadState& tls()
+    {
+        static thread_local ThreadState state;
+        return state;
+    }
+
+    Task* findTask(int self);
+    void workerLoop(int index);
+    // cores the process may run on (taskset, cgroups and containers restrict
+    // them), read once before any thread is pinned; empty if unknown
+    static const std::vector<int>& allowedCores();
+    // bind the calling thread to the index-th allowed core, leaves it unpinned on failure
+    static void pinCurrentThread(size_t index);
+
+    std::vector<std::unique_ptr<WorkStealingDeque>> queues;
+    std::vector<std::thread> workers;
+    std::atomic<size_t> started{0};
+    bool pinThreads;
+
+    std::mutex injectMutex;
+    std::deque<Task*> injected;
+
+    // sleeping support, a worker only sleeps when no task is queued anywhere
+    std::atomic<int64_t> queued{0};
+    std::atomic<int> sleepers{0};
+    std::mutex sleepMutex;
+    std::condition_variable wakeup;
+    std::atomic<bool> stop{false};
+
+    static inline std::unique_ptr<TaskScheduler> instance;
+};
+
+inline TaskScheduler::TaskScheduler(size_t numThreads, bool pinThreads)
+    : pinThreads(pinThreads)
+{
+    numThreads = std::max<size_t>(1, numThreads);
+    queues.resize(numThreads);
+
+    if (pinThreads)
+        pinCurrentThread(0);
+    queues[0].reset(new WorkStealingDeque());
+    tls() = ThreadState{this, 0, 0x9e3779b9u};
+
+    // workers allocate their own deque so it lands on their NUMA node,
+    // nobody may steal before every deque exists
+    started = 1;
+    for (size_t i = 1; i < numThreads; ++i)
+        workers.emplace_back([this, i] {
+            if (this->pinThreads)
+                pinCurrentThread(i);
+            queues[i].reset(new WorkStealingDeque());
+            started.fetch_add(1);
+            while (started.load() < queues.size())
+                std::this_thread::yield();
+            workerLoop((int)i);
+        });
+    while (started.load() < numThreads)
+        std::this_thread::yield();
+}
+
+inline TaskScheduler::~TaskScheduler()
+{
+    {
+        std::lock_guard<std::mutex> lock(sleepMutex);
+        stop = true;
+    }
+    wakeup.notify_all();
+    for (auto& worker : workers)
+        worker.join();
+    if (tls().owner == this)
+        tls() = ThreadState{};
+}
+
+inline void TaskScheduler::spawn(Task* task)
+{
+    int self = workerIndex();
+    if (self >= 0) {
+        queues[self]->push(task);
+    }
+    else {
+        std::lock_guard<std::mutex> lock(injectMutex);
+        injected.push_back(task);
+    }
+    queued.fetch_add(1);
+    if (sleepers.load() > 0) {
+        std::lock_guard<std::mutex> lock(sleepMutex);
+        wakeup.notify_one();
+    }
+}
+
+inline Task* TaskScheduler::findTask(int self)
+{
+    Task* task = nullptr;
+    if (self >= 0)
+        task = queues[self]->pop();
+
+    if (!task && queues.size() > 1) {
+        // xorshift32 picks the first victim, then sweep all other workers
+        uint32_t& r = tls().rng;
+        r ^= r << 13; r ^= r >> 17; r ^= r << 5;
+        size_t n = queues.size();
+        size_t start = r % n;
+        for (size_t k = 0; k < n && !task; ++k) {
+            size_t victim = (start + k) % n;
+            if ((int)victim != self)
+                task = queues[victim]->steal();
+        }
+    }
+
+    if (!task) {
+        std::lock_guard<std::mutex> lock(injectMutex);
+        if (!injected.empty()) {
+            task = injected.front();
+            injected.pop_front();
+        }
+    }
+
+    if (task)
+        queued.fetch_sub(1);
+    return task;
+}
+
+inline bool TaskScheduler::runOne()
+{
+    Task* task = findTask(workerIndex());
+    if (!task)
+        return false;
+    task->execute();
+    delete task;
+    return true;
+}
+
+inline void TaskScheduler::workerLoop(int index)
+{
+    tls() = ThreadState{this, index, 0x9e3779b9u * (uint32_t)(index + 1)};
+    int idle = 0;
+    while (!stop.load(std::memory_order_relaxed)) {
+        if (runOne()) {
+            idle = 0;
+            continue;
+        }
+        if (++idle < 64) {
+            std::this_thread::yield();
+            continue;
+        }
+        std::unique_lock<std::mutex> lock(sleepMutex);
+        sleepers.fetch_add(1);
+        wakeup.wait(lock, [this] { return stop.load() || queued.load() > 0; });
+        sleepers.fetch_sub(1);
+        idle = 0;
+    }
+}
+
+inline const std::vector<int>& TaskScheduler::allowedCores()
+{
+    static const std::vector<int> cores = [] {
+        std::vector<int> cores;
+#ifdef __linux__
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        if (sched_getaffinity(0, sizeof(set), &set) == 0)
+            for (int c = 0; c < CPU_SETSIZE; ++c)
+                if (CPU_ISSET(c, &set))
+                    cores.push_back(c);
+#endif
+        return cores;
+    }();
+    return cores;
+}
+
+inline void TaskScheduler::pinCurrentThread(size_t index)
+{
+#ifdef __linux__
+    const std::vector<int>& cores = allowedCores();
+    if (cores.empty()) {
+        printf("Cannot read the allowed cores, worker %zu is not pinned\n", index);
+        return;
+    }
+    int core = cores[index % cores.size()];
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(core, &set);
+    int error = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (error != 0)
+        printf("Cannot pin worker %zu to core %d: %s\n", index, core, strerror(error));
+#else
+    (void)index;
+#endif
+}
+
+inline size_t TaskScheduler::defaultThreadCount()
+{
+    if (const char* env = std::getenv("RT_THREADS")) {
+        int n = std::atoi(env);
+        if (n > 0)
+            return n;
+    }
+    return std::max(1u, std::thread::hardware_concurrency());
+}
+
+inline void TaskScheduler::init(size_t numThreads, bool pinThreads)
+{
+    instance.reset();
+    instance.reset(new TaskScheduler(numThreads, pinThreads));
+}
+
+inline TaskScheduler& TaskScheduler::get()
+{
+    if (!instance)
+        init(defaultThreadCount());
+    return *instance;
+}
+
+// Fork-join scope: run() spawns tasks, wait() helps executing pending work
+// until every task spawned through this group (including nested ones) is done.
+class TaskGroup
+{
+public:
+    explicit TaskGroup(TaskScheduler& scheduler = TaskScheduler::get()) : scheduler(scheduler) {}
+    ~TaskGroup() { wait(); }
+
+    template<class F>
+    void run(F&& f)
+    {
+        struct FunctionTask : Task
+        {
+            TaskGroup* group;
+            std::decay_t<F> func;
+            FunctionTask(TaskGroup* g, F&& f) : group(g), func(std::forward<F>(f)) {}
+            void execute() override
+            {
+                func();
+                group->pending.fetch_sub(1, std::memory_order_release);
+            }
+        };
+        pending.fetch_add(1, std::memory_order_relaxed);
+        scheduler.spawn(new FunctionTask(this, std::forward<F>(f)));
+    }
+
+    void wait()
+    {
+        while (pending.load(std::memory_order_acquire) > 0) {
+            if (!scheduler.runOne())
+                std::this_thread::yield();
+        }
+    }
+
+private:
+    TaskScheduler& scheduler;
+    std::atomic<int64_t> pending{0};
+};
+
+namespace detail
+{
+    template<class F>
+    void parallelForRange(TaskGroup& group, int64_t begin, int64_t end, int64_t grain, const F& f)
+    {
+        // hand the upper halves to thieves, keep splitting the lower one ourselves
+        while (end - begin > grain) {
+            int64_t mid = begin + (end - begin) / 2;
+            group.run([&group, mid, end, grain, &f] { parallelForRange(group, mid, end, grain, f); });
+            end = mid;
+        }
+        for (int64_t i = begin; i < end; ++i)
+            f(i);
+    }
+}
+
+// Call f(i) for every i in [begin, end), in chunks of at most grain iterations.
+template<class F>
+void parallel_for(int64_t begin, int64_t end, int64_t grain, const F& f)
+{
+    if (begin >= end)
+        return;
+    TaskGroup group;
+    detail::parallelForRange(group, begin, end, std::max<int64_t>(1, grain), f);
+    group.wait();
+}
+
+// Reduce [begin, end) in parallel: chunk(b, e) computes the partial result of a
+// sub-range of at most grain iterations, combine(a, b) merges two partial results.
+// Partials are merged in range order, so combine only needs to be associative.
+template<class T, class Chunk, class Combine>
+T parallel_reduce(int64_t begin, int64_t end, int64_t grain, T identity,
+                  const Chunk& chunk, const Combine& combine)
+{
+    if (begin >= end)
+        return identity;
+    grain = std::max<int64_t>(1, grain);
+    int64_t nChunks = (end - begin + grain - 1) / grain;
+    if (nChunks == 1)
+        return combine(identity, chunk(begin, end));
+
+    std::vector<T> partials(nChunks, identity);
+    parallel_for(0, nChunks, 1, [&](int64_t c) {
+        int64_t b = begin + c * grain;
+        partials[c] = chunk(b, std::min(end, b + grain));
+    });
+    T result = identity;
+    for (auto& partial : partials)
+        result = combine(result, partial);
+    return result;
+}
@@ -0,0 +1,112 @@
+#pragma once
+#include <cmath>
+#include "Vector.hpp"
+#include "Bounds3.hpp"
+#include "global.hpp"
+
+// Affine transform stored as the upper 3x4 part of a 4x4 matrix (the last row
+// is always 0 0 0 1) together with its inverse, so that normals and inverse
+// mappings come for free.
+class Transform
+{
+public:
+    float m[3][4], mInv[3][4];
+
+    Transform()
+    {
+        for (int i = 0; i < 3; ++i)
+            for (int j = 0; j < 4; ++j)
+                m[i][j] = mInv[i][j] = (i == j) ? 1.0f : 0.0f;
+    }
+
+    static Transform translate(const Vector3f& t)
+    {
+        Transform xf;
+        xf.m[0][3] = t.x; xf.m[1][3] = t.y; xf.m[2][3] = t.z;
+        xf.mInv[0][3] = -t.x; xf.mInv[1][3] = -t.y; xf.mInv[2][3] = -t.z;
+        return xf;
+    }
+
+    static Transform scale(const Vector3f& s)
+    {
+        Transform xf;
+        xf.m[0][0] = s.x; xf.m[1][1] = s.y; xf.m[2][2] = s.z;
+        xf.mInv[0][0] = 1 / s.x; xf.mInv[1][1] = 1 / s.y; xf.mInv[2][2] = 1 / s.z;
+        return xf;
+    }
+
+    // rotation around the y (up) axis, angle in degrees
+    static Transform rotateY(float deg)
+    {
+        Transform xf;
+        float c = std::cos(deg2rad(deg)), s = std::sin(deg2rad(deg));
+        xf.m[0][0] = c;  xf.m[0][2] = s;
+        xf.m[2][0] = -s; xf.m[2][2] = c;
+        xf.mInv[0][0] = c; xf.mInv[0][2] = -s;
+        xf.mInv[2][0] = s; xf.mInv[2][2] = c;
+        return xf;
+    }
+
+    Transform inverse() const
+    {
+        Transform xf;
+        std::copy(&mInv[0][0], &mInv[0][0] + 12, &xf.m[0][0]);
+        std::copy(&m[0][0], &m[0][0] + 12, &xf.mInv[0][0]);
+        return xf;
+    }
+
+    // this * t: t is applied first
+    Transform operator*(const Transform& t) const
+    {
+        Transform xf;
+        compose(m, t.m, xf.m);
+        compose(t.mInv, mInv, xf.mInv);
+        return xf;
+    }
+
+    Vector3f point(const Vector3f& p) const
+    {
+        return Vector3f(m[0][0] * p.x + m[0][1] * p.y + m[0][2] * p.z + m[0][3],
+                        m[1][0] * p.x + m[1][1] * p.y + m[1][2] * p.z + m[1][3],
+                        m[2][0] * p.x + m[2][1] * p.y + m[2][2] * p.z + m[2][3]);
+    }
+
+    Vector3f vector(const Vector3f& v) const
+    {
+        return Vector3f(m[0][0] * v.x + m[0][1] * v.y + m[0][2] * v.z,
+                        m[1][0] * v.x + m[1][1] * v.y + m[1][2] * v.z,
+                        m[2][0] * v.x + m[2][1] * v.y + m[2][2] * v.z);
+    }
+
+    // normals transform with the inverse transpose, the result is not normalized
+    Vector3f normal(const Vector3f& n) const
+    {
+        return Vector3f(mInv[0][0] * n.x + mInv[1][0] * n.y + mInv[2][0] * n.z,
+                        mInv[0][1] * n.x + mInv[1][1] * n.y + mInv[2][1] * n.z,
+                        mInv[0][2] * n.x + mInv[1][2] * n.y + mInv[2][2] * n.z);
+    }
+
+    Bounds3 bounds(const Bounds3& b) const
+    {
+        Bounds3 ret;
+        for (int corner = 0; corner < 8; ++corner) {
+            Vector3f p((corner & 1) ? b.pMax.x : b.pMin.x,
+                       (corner & 2) ? b.pMax.y : b.pMin.y,
+                       (corner & 4) ? b.pMax.z : b.pMin.z);
+            ret = Union(ret, point(p));
+        }
+        return ret;
+    }
+
+private:
+    static void compose(const float a[3][4], const float b[3][4], float out[3][4])
+    {
+        for (int i = 0; i < 3; ++i) {
+            for (int j = 0; j < 4; ++j) {
+                out[i][j] = a[i][0] * b[0][j] + a[i][1] * b[1][j] + a[i][2] * b[2][j];
+                if (j == 3)
+                    out[i][j] += a[i][3];
+            }
+        }
+    }
+};
@@ -1,13 +1,17 @@
 #pragma once
 
+#include "AliasTable.hpp"
 #include "BVH.hpp"
 #include "Intersection.hpp"
 #include "Material.hpp"
-#include "OBJ_Loader.hpp"
+#include "ObjParser.hpp"
 #include "Object.hpp"
-#include "Triangle.hpp"
+#include "TriangleMesh.hpp"
+#include "MeshCache.hpp"
 #include <cassert>
+#include <chrono>
 #include <array>
+#include <mutex>
 
 class Triangle : public Object
 {
@@ -29,10 +33,11 @@ public:
     }
 
     Intersection getIntersection(Ray ray) override;
+    bool intersectP(const Ray& ray) override;
     Bounds3 getBounds() override;
-    void Sample(Intersection &pos, float &pdf){
+    void Sample(Intersection &pos, float &pdf, const Vector2f &, const Vector2f &u){
         // uniformly sample on a triangle
-        float x = std::sqrt(get_random_float()), y = get_random_float();
+        float x = std::sqrt(u.x), y = u.y;
         pos.coords = v0 * (1.0f - x) + v1 * (x * (1.0f - y)) + v2 * (x * y);
         pos.normal = this->normal;
         pdf = 1.0f / area;
@@ -45,54 +50,62 @@ public:
     }
 };
 
+// Triangle mesh loaded from an OBJ file. The geometry is indexed (see
+// TriangleMesh), the BVH stores face indices instead of one Object per face.
+// After the first load the geometry and BVH come from the MeshCache file.
 class Mesh : public Object
 {
 public:
-    Mesh(const std::string& filename, Material *mt = new Material())
+    Mesh(const std::string& filename, Material *mt = new Material()) : sourcePath(filename)
     {
-        objl::Loader loader;
-        loader.LoadFile(filename);
-        area = 0;
         m = mt;
-        assert(loader.LoadedMeshes.size() == 1);
-        auto mesh = loader.LoadedMeshes[0];
-
-        Vector3f min_vert = Vector3f{std::numeric_limits<float>::infinity(),
-                                     std::numeric_limits<float>::infinity(),
-                                     std::numeric_limits<float>::infinity()};
-        Vector3f max_vert = Vector3f{-std::numeric_limits<float>::infinity(),
-                                     -std::numeric_limits<float>::infinity(),
-                                     -std::numeric_limits<float>::infinity()};
-        for (int i = 0; i < mesh.Vertices.size(); i += 3) {
-            std::array<Vector3f, 3> face_vertices;
-
-            for (int j = 0; j < 3; j++) {
-                auto vert = Vector3f(mesh.Vertices[i + j].Position.X,
-                                     mesh.Vertices[i + j].Position.Y,
-                                     mesh.Vertices[i + j].Position.Z);
-                face_vertices[j] = vert;
-
-                min_vert = Vector3f(std::min(min_vert.x, vert.x),
-                                    std::min(min_vert.y, vert.y),
-                                    std::min(min_vert.z, vert.z));
-                max_vert = Vector3f(std::max(max_vert.x, vert.x),
-                                    std::max(max_vert.y, vert.y),
-                                    std::max(max_vert.z, vert.z));
-            }
-
-            triangles.emplace_back(face_vertices[0], face_vertices[1],
-                                   face_vertices[2], mt);
-        }
+        bvh = nullptr;
+        geometry.materials.push_back(mt);
+
+        auto start = std::chrono::steady_clock::now();
+        cache = MeshCache::load(filename);
+        if (cache)
+            cache->getGeometry(geometry);
+        else
+            parse(filename);
+        init();
+        if (!loadError.empty())
+            return;
+        auto stop = std::chrono::steady_clock::now();
+        double ms = std::chrono::duration<double, std::milli>(stop - start).count();
+        // one printf per line, meshes may be loaded concurrently
+        char throughput[32] = "";
+        if (!cache)
+            snprintf(throughput, sizeof(throughput), " (%.1f MB/s)", parseBytes / (ms * 1e3));
+        printf("%s %s: %zu faces, %zu vertices in %.2f ms%s\n", cache ? "Mapped cache of" : "Parsed",
+               filename.c_str(), geometry.numFaces(), geometry.numVertices, ms, throughput);
+    }
 
-        bounding_box = Bounds3(min_vert, max_vert);
+    // wrap geometry that is already indexed, e.g. the merged meshes of a flattened scene
+    explicit Mesh(TriangleMesh geometry) : geometry(std::move(geometry))
+    {
+        m = this->geometry.materials[0];
+        bvh = nullptr;
+        init();
+    }
 
-        std::vector<Object*> ptrs;
-        for (auto& tri : triangles){
-            ptrs.push_back(&tri);
-            area += tri.area;
+    ~Mesh() { delete bvh; }
+
+    // build a bvh over the mesh faces, Scene::buildBVH calls this for all meshes concurrently
+    // and only then for their instances, which find the bvh already built. BVHs of
+    // meshes loaded from OBJ files are stored in (and restored from) the mesh cache.
+    void buildBVH(const BVHBuildOptions& options) override
+    {
+        std::lock_guard<std::mutex> lock(bvhMutex);
+        if (!bvh && cache)
+            bvh = cache->getBVH(&geometry, this, options.splitMethod);
+        if (!bvh) {
+            // leaves of up to four triangles, intersected as one SSE packet
+            bvh = new BVHAccel(&geometry, this, options.splitMethod);
+            if (!sourcePath.empty())
+                MeshCache::write(sourcePath, geometry, bvh);
         }
-        // build a bvh for every mesh triangle
-        bvh = new BVHAccel(ptrs);
+        bvh->setWide(options.wide);
     }
 
     Bounds3 getBounds() { return bounding_box; }
@@ -107,10 +120,18 @@ public:
 
         return intersec;
     }
-    
-    void Sample(Intersection &pos, float &pdf){
-        bvh->Sample(pos, pdf);
-        pos.emit = m->getEmission();
+
+    bool intersectP(const Ray& ray)
+    {
+        return bvh && bvh->IntersectP(ray);
+    }
+
+    void Sample(Intersection &pos, float &pdf, const Vector2f &uFace, const Vector2f &uPoint){
+        // pick a face proportional to its area, then a uniform point on it
+        size_t face = faceTable.sample(uFace.x, uFace.y);
+        geometry.sampleFace(face, uPoint, pos);
+        pdf = 1.0f / area;
+        pos.emit = geometry.material(face)->getEmission();
     }
     float getArea(){
         return area;
@@ -120,17 +141,45 @@ public:
     }
 
     Bounds3 bounding_box;
-    std::unique_ptr<Vector3f[]> vertices;
-    uint32_t numTriangles;
-    std::unique_ptr<uint32_t[]> vertexIndex;
-    std::unique_ptr<Vector2f[]> stCoordinates;
-
-    std::vector<Triangle> triangles;
+    TriangleMesh geometry;
+    // faces by area, for sampling
+    AliasTable faceTable;
 
     BVHAccel* bvh;
+    std::mutex bvhMutex;
     float area;
 
     Material* m;
+
+    // OBJ file the mesh was loaded from, empty for generated geometry
+    std::string sourcePath;
+    size_t parseBytes = 0;
+    std::shared_ptr<MeshCache> cache;
+    // why the OBJ file could not be parsed, empty if it was; the mesh has no faces then
+    std::string loadError;
+
+private:
+    void parse(const std::string& filename)
+    {
+        ObjParser parser;
+        if (!parser.parse(filename)) {
+            loadError = parser.error;
+            return;
+        }
+        parseBytes = parser.bytes;
+        geometry.own(std::move(parser.vertices), std::move(parser.indices));
+    }
+
+    void init()
+    {
+        for (size_t i = 0; i < geometry.numVertices; ++i)
+            bounding_box = Union(bounding_box, geometry.vertices[i]);
+        std::vector<float> faceAreas(geometry.numFaces());
+        for (size_t f = 0; f < geometry.numFaces(); ++f)
+            faceAreas[f] = geometry.faceArea(f);
+        faceTable.build(faceAreas);
+        area = faceTable.total;
+    }
 };
 
 inline Bounds3 Triangle::getBounds() { return Union(Bounds3(v0, v1), v2); }
@@ -138,35 +187,20 @@ inline Bounds3 Triangle::getBounds() { return Union(Bounds3(v0, v1), v2); }
 inline Intersection Triangle::getIntersection(Ray ray)
 {
     Intersection inter;
-
-    if (dotProduct(ray.direction, normal) > 0)
-        return inter;
-    double u, v, t_tmp = 0;
-    Vector3f pvec = crossProduct(ray.direction, e2);
-    double det = dotProduct(e1, pvec);
-    if (fabs(det) < EPSILON)
-        return inter;
-
-    double det_inv = 1. / det;
-    Vector3f tvec = ray.origin - v0;
-    u = dotProduct(tvec, pvec) * det_inv;
-    if (u < 0 || u > 1)
-        return inter;
-    Vector3f qvec = crossProduct(tvec, e1);
-    v = dotProduct(ray.direction, qvec) * det_inv;
-    if (v < 0 || u + v > 1)
-        return inter;
-    t_tmp = dotProduct(e2, qvec) * det_inv;
-
-    // find ray triangle intersection
-    if(t_tmp > 0){
+    double t;
+    if (intersectTriangle(ray, v0, e1, e2, normal, t)) {
         inter.happened = true;
-        inter.coords = ray.origin + t_tmp * ray.direction;
+        inter.coords = ray.origin + t * ray.direction;
         inter.normal = normal;
-        inter.distance = t_tmp;
+        inter.distance = t;
         inter.obj = this;
         inter.m = m;
     }
-
     return inter;
 }
+
+inline bool Triangle::intersectP(const Ray& ray)
+{
+    double t;
+    return intersectTriangle(ray, v0, e1, e2, normal, t) && t < ray.t_max;
+}
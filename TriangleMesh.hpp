@@ -0,0 +1,157 @@
+#pragma once
+#include <cstdint>
+#include <memory>
+#include <vector>
+#include "Vector.hpp"
+#include "Bounds3.hpp"
+#include "Ray.hpp"
+#include "Intersection.hpp"
+#include "Material.hpp"
+#include "global.hpp"
+
+// Moller-Trumbore test of a ray against the triangle (v0, v0 + e1, v0 + e2),
+// back faces are culled. Stores the distance in t and returns true on a hit with t > 0.
+inline bool intersectTriangle(const Ray& ray, const Vector3f& v0, const Vector3f& e1, const Vector3f& e2,
+                              const Vector3f& normal, double& t)
+{
+    if (dotProduct(ray.direction, normal) > 0)
+        return false;
+    double u, v;
+    Vector3f pvec = crossProduct(ray.direction, e2);
+    double det = dotProduct(e1, pvec);
+    if (fabs(det) < EPSILON)
+        return false;
+
+    double det_inv = 1. / det;
+    Vector3f tvec = ray.origin - v0;
+    u = dotProduct(tvec, pvec) * det_inv;
+    if (u < 0 || u > 1)
+        return false;
+    Vector3f qvec = crossProduct(tvec, e1);
+    v = dotProduct(ray.direction, qvec) * det_inv;
+    if (v < 0 || u + v > 1)
+        return false;
+    t = dotProduct(e2, qvec) * det_inv;
+    return t > 0;
+}
+
+// Indexed triangle geometry: every vertex is stored once and a face is three
+// 32 bit indices into vertices. Edges, normals and areas are derived from the
+// vertices when needed, the BVH refers to faces by their index.
+struct TriangleMesh
+{
+    // the buffers point either into vertexStorage/indexStorage or into a memory
+    // mapped mesh cache that mapping keeps alive
+    const Vector3f* vertices = nullptr;
+    const uint32_t* indices = nullptr;   // 3 per face, counter-clockwise
+    size_t numVertices = 0, numIndices = 0;
+    std::vector<Vector3f> vertexStorage;
+    std::vector<uint32_t> indexStorage;
+    std::shared_ptr<const void> mapping;
+
+    std::vector<Material*> materials;
+    // per face index into materials, empty if every face uses materials[0]
+    std::vector<uint16_t> faceMaterials;
+
+    TriangleMesh() = default;
+    // moving keeps the vector buffers in place, copying would leave dangling pointers
+    TriangleMesh(TriangleMesh&&) = default;
+    TriangleMesh(const TriangleMesh&) = delete;
+    TriangleMesh& operator=(const TriangleMesh&) = delete;
+
+    // take ownership of the buffers
+    void own(std::vector<Vector3f> v, std::vector<uint32_t> i)
+    {
+        vertexStorage = std::move(v);
+        indexStorage = std::move(i);
+        vertices = vertexStorage.data();
+        indices = indexStorage.data();
+        numVertices = vertexStorage.size();
+        numIndices = indexStorage.size();
+        mapping.reset();
+    }
+
+    size_t numFaces() const { return numIndices / 3; }
+    const Vector3f& vertex(size_t face, int k) const { return vertices[indices[3 * face + k]]; }
+    Material* material(size_t face) const
+    {
+        return faceMaterials.empty() ? materials[0] : materials[faceMaterials[face]];
+    }
+
+    // edges v1 - v0 and v2 - v0
+    void edges(size_t face, Vector3f& e1, Vector3f& e2) const
+    {
+        e1 = vertex(face, 1) - vertex(face, 0);
+        e2 = vertex(face, 2) - vertex(face, 0);
+    }
+    Bounds3 faceBounds(size_t face) const
+    {
+        return Union(Bounds3(vertex(face, 0), vertex(face, 1)), vertex(face, 2));
+    }
+    float faceArea(size_t face) const
+    {
+        Vector3f e1, e2;
+        edges(face, e1, e2);
+        return crossProduct(e1, e2).norm() * 0.5f;
+    }
+    Vector3f faceNormal(size_t face) const
+    {
+        Vector3f e1, e2;
+        edges(face, e1, e2);
+        return normalize(crossProduct(e1, e2));
+    }
+
+    // closest hit with one face, isect is only written if the face is hit
+    bool intersect(size_t face, const Ray& ray, Intersection& isect) const
+    {
+        Vector3f e1, e2;
+        edges(face, e1, e2);
+        Vector3f normal = normalize(crossProduct(e1, e2));
+        double t;
+        if (!intersectTriangle(ray, vertex(face, 0), e1, e2, normal, t))
+            return false;
+        isect.happened = true;
+        isect.coords = ray.origin + t * ray.direction;
+        isect.normal = normal;
+        isect.distance = t;
+        isect.m = material(face);
+        isect.face = face;
+        return true;
+    }
+
+    // any-hit test of one face in (0, ray.t_max)
+    bool intersectP(size_t face, const Ray& ray) const
+    {
+        Vector3f e1, e2;
+        edges(face, e1, e2);
+        double t;
+        return intersectTriangle(ray, vertex(face, 0), e1, e2, normalize(crossProduct(e1, e2)), t) && t < ray.t_max;
+    }
+
+    // uniform point on a face
+    void sampleFace(size_t face, const Vector2f& u, Intersection& pos) const
+    {
+        float x = std::sqrt(u.x), y = u.y;
+        pos.coords = vertex(face, 0) * (1.0f - x) + vertex(face, 1) * (x * (1.0f - y)) + vertex(face, 2) * (x * y);
+        pos.normal = faceNormal(face);
+    }
+
+    // add the faces of other, keeping their materials
+    void append(const TriangleMesh& other)
+    {
+        if (faceMaterials.empty() && !materials.empty())
+            faceMaterials.assign(numFaces(), 0);
+        if (vertices != vertexStorage.data() || indices != indexStorage.data())
+            own(std::vector<Vector3f>(vertices, vertices + numVertices),
+                std::vector<uint32_t>(indices, indices + numIndices));
+        uint32_t base = numVertices;
+        vertexStorage.insert(vertexStorage.end(), other.vertices, other.vertices + other.numVertices);
+        for (size_t i = 0; i < other.numIndices; ++i)
+            indexStorage.push_back(base + other.indices[i]);
+        own(std::move(vertexStorage), std::move(indexStorage));
+        uint16_t firstMaterial = materials.size();
+        materials.insert(materials.end(), other.materials.begin(), other.materials.end());
+        for (size_t f = 0; f < other.numFaces(); ++f)
+            faceMaterials.push_back(firstMaterial + (other.faceMaterials.empty() ? 0 : other.faceMaterials[f]));
+    }
+};
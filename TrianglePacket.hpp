@@ -0,0 +1,103 @@
+#pragma once
+#include <limits>
+#include "Vector.hpp"
+#include "Ray.hpp"
+#include "global.hpp"
+
+#if defined(__SSE__) || defined(_M_X64)
+#include <xmmintrin.h>
+#define TRIANGLE_PACKET_USE_SSE
+#endif
+
+// Up to four triangles of a BVH leaf in structure of arrays layout, so that one
+// SSE Moller-Trumbore kernel tests all of them against a ray. Unused lanes keep
+// zero edges, which gives a zero determinant and never hits.
+struct alignas(16) TrianglePacket
+{
+    static constexpr int width = 4;
+
+    float v0x[width] = {}, v0y[width] = {}, v0z[width] = {};
+    float e1x[width] = {}, e1y[width] = {}, e1z[width] = {};
+    float e2x[width] = {}, e2y[width] = {}, e2z[width] = {};
+
+    void set(int lane, const Vector3f& v0, const Vector3f& e1, const Vector3f& e2)
+    {
+        v0x[lane] = v0.x; v0y[lane] = v0.y; v0z[lane] = v0.z;
+        e1x[lane] = e1.x; e1y[lane] = e1.y; e1z[lane] = e1.z;
+        e2x[lane] = e2.x; e2y[lane] = e2.y; e2z[lane] = e2.z;
+    }
+
+    // Returns a mask of the lanes with a front-facing hit with t in (0, tMax),
+    // bit i for lane i, and stores the hit distances in t. Back faces are culled
+    // like in Triangle::getIntersection.
+    inline int intersect(const Ray& ray, float tMax, float t[width]) const;
+
+    // lane of the nearest hit in mask, or -1 if mask is empty
+    static int nearest(int mask, const float t[width])
+    {
+        int lane = -1;
+        for (int i = 0; i < width; ++i)
+            if ((mask & (1 << i)) && (lane < 0 || t[i] < t[lane]))
+                lane = i;
+        return lane;
+    }
+};
+
+inline int TrianglePacket::intersect(const Ray& ray, float tMax, float t[width]) const
+{
+    int mask = 0;
+#ifdef TRIANGLE_PACKET_USE_SSE
+    const __m128 dx = _mm_set1_ps(ray.direction.x), dy = _mm_set1_ps(ray.direction.y), dz = _mm_set1_ps(ray.direction.z);
+    const __m128 e1X = _mm_load_ps(e1x), e1Y = _mm_load_ps(e1y), e1Z = _mm_load_ps(e1z);
+    const __m128 e2X = _mm_load_ps(e2x), e2Y = _mm_load_ps(e2y), e2Z = _mm_load_ps(e2z);
+
+    // pvec = dir x e2, det = e1 . pvec
+    __m128 px = _mm_sub_ps(_mm_mul_ps(dy, e2Z), _mm_mul_ps(dz, e2Y));
+    __m128 py = _mm_sub_ps(_mm_mul_ps(dz, e2X), _mm_mul_ps(dx, e2Z));
+    __m128 pz = _mm_sub_ps(_mm_mul_ps(dx, e2Y), _mm_mul_ps(dy, e2X));
+    __m128 det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e1X, px), _mm_mul_ps(e1Y, py)), _mm_mul_ps(e1Z, pz));
+    __m128 valid = _mm_cmpge_ps(det, _mm_set1_ps(EPSILON));
+    __m128 detInv = _mm_div_ps(_mm_set1_ps(1.0f), det);
+
+    // tvec = origin - v0, u = tvec . pvec / det
+    __m128 tx = _mm_sub_ps(_mm_set1_ps(ray.origin.x), _mm_load_ps(v0x));
+    __m128 ty = _mm_sub_ps(_mm_set1_ps(ray.origin.y), _mm_load_ps(v0y));
+    __m128 tz = _mm_sub_ps(_mm_set1_ps(ray.origin.z), _mm_load_ps(v0z));
+    __m128 u = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(tx, px), _mm_mul_ps(ty, py)), _mm_mul_ps(tz, pz)), detInv);
+    valid = _mm_and_ps(valid, _mm_and_ps(_mm_cmpge_ps(u, _mm_setzero_ps()), _mm_cmple_ps(u, _mm_set1_ps(1.0f))));
+
+    // qvec = tvec x e1, v = dir . qvec / det, t = e2 . qvec / det
+    __m128 qx = _mm_sub_ps(_mm_mul_ps(ty, e1Z), _mm_mul_ps(tz, e1Y));
+    __m128 qy = _mm_sub_ps(_mm_mul_ps(tz, e1X), _mm_mul_ps(tx, e1Z));
+    __m128 qz = _mm_sub_ps(_mm_mul_ps(tx, e1Y), _mm_mul_ps(ty, e1X));
+    __m128 v = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, qx), _mm_mul_ps(dy, qy)), _mm_mul_ps(dz, qz)), detInv);
+    valid = _mm_and_ps(valid, _mm_and_ps(_mm_cmpge_ps(v, _mm_setzero_ps()),
+                                         _mm_cmple_ps(_mm_add_ps(u, v), _mm_set1_ps(1.0f))));
+    __m128 tt = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(e2X, qx), _mm_mul_ps(e2Y, qy)), _mm_mul_ps(e2Z, qz)), detInv);
+    valid = _mm_and_ps(valid, _mm_and_ps(_mm_cmpgt_ps(tt, _mm_setzero_ps()), _mm_cmplt_ps(tt, _mm_set1_ps(tMax))));
+
+    _mm_storeu_ps(t, tt);
+    mask = _mm_movemask_ps(valid);
+#else
+    for (int i = 0; i < width; ++i) {
+        Vector3f e1(e1x[i], e1y[i], e1z[i]), e2(e2x[i], e2y[i], e2z[i]);
+        Vector3f pvec = crossProduct(ray.direction, e2);
+        float det = dotProduct(e1, pvec);
+        if (det < EPSILON)
+            continue;
+        float detInv = 1.0f / det;
+        Vector3f tvec = ray.origin - Vector3f(v0x[i], v0y[i], v0z[i]);
+        float u = dotProduct(tvec, pvec) * detInv;
+        if (u < 0 || u > 1)
+            continue;
+        Vector3f qvec = crossProduct(tvec, e1);
+        float v = dotProduct(ray.direction, qvec) * detInv;
+        if (v < 0 || u + v > 1)
+            continue;
+        t[i] = dotProduct(e2, qvec) * detInv;
+        if (t[i] > 0 && t[i] < tMax)
+            mask |= 1 << i;
+    }
+#endif
+    return mask;
+}
@@ -1,4 +1,3 @@
 #include "global.hpp"
 
-const float EPSILON = 0.0001;
-thread_local std::mt19937 rng(std::random_device{}());
\ No newline at end of file
+const float EPSILON = 0.0001;
\ No newline at end of file
@@ -1,18 +1,19 @@
 #pragma once
 #include <iostream>
 #include <cmath>
-#include <random>
 #include "Vector.hpp"
 
 #undef M_PI
 #define M_PI 3.141592653589793f
 
 extern const float  EPSILON;
-extern thread_local std::mt19937 rng;
 const float kInfinity = std::numeric_limits<float>::max();
 
 inline float deg2rad(const float& deg) { return deg * M_PI / 180.0; }
 
+// Rec. 709 luminance of a linear RGB color
+inline float luminance(const Vector3f& c) { return 0.2126f * c.x + 0.7152f * c.y + 0.0722f * c.z; }
+
 inline float clamp(const float &lo, const float &hi, const float &v)
 { return std::max(lo, std::min(hi, v)); }
 
@@ -35,11 +36,6 @@ inline bool solveQuadratic(const float &a, const float &b, const float &c, float
     return true;
 }
 
-inline float get_random_float()
-{
-    return std::uniform_real_distribution<float>{0.f, 1.f}(rng);
-}
-
 inline void UpdateProgress(float progress)
 {
     int barWidth = 70;
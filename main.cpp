@@ -2,9 +2,332 @@
 #include "Scene.hpp"
 #include "Triangle.hpp"
 #include "Sphere.hpp"
+#include "Instance.hpp"
+#include "SceneLoader.hpp"
 #include "Vector.hpp"
 #include "global.hpp"
+#include "TaskScheduler.hpp"
+#include "ObjParser.hpp"
+#include "OBJ_Loader.hpp"
 #include <chrono>
+#include <cstring>
+#include <filesystem>
+#include <string>
+
+struct Options
+{
+    size_t threads = TaskScheduler::defaultThreadCount();
+    bool pinThreads = std::getenv("RT_PIN") != nullptr;
+    int spp = 512;
+    int primaryStrata = 1;
+    float adaptiveThreshold = 0;
+    int adaptiveMinSpp = 16;
+    bool progressive = false;
+    double timeLimit = 0;
+    bool scalingReport = false;
+    BVHAccel::SplitMethod splitMethod = BVHAccel::SplitMethod::SAH;
+    bool wideBVH = false;
+    bool flattenBVH = false;
+    bool benchmarkAccel = false;
+    bool benchmarkObj = false;
+    int instances = 0;
+    int panels = 0;
+    LightSampling lightSampling = LightSampling::BVH;
+    SamplerType samplerType = SamplerType::SOBOL;
+    uint32_t seed = std::getenv("RT_SEED") ? std::strtoul(std::getenv("RT_SEED"), nullptr, 10) : 0;
+};
+
+static void printUsage(const char* prog)
+{
+    std::cout << "Usage: " << prog << " [options]\n"
+              << "  --threads N   number of worker threads (default: RT_THREADS or all hardware threads)\n"
+              << "  --pin         pin every worker to its own core (also enabled by RT_PIN)\n"
+              << "  --spp N       samples per pixel (default: 512)\n"
+              << "  --strata N    cache N x N camera rays per pixel for antialiasing, jittered if N > 1 (default: 1)\n"
+              << "  --adaptive T  stop pixels at relative error T; --spp becomes the average budget (default: off)\n"
+              << "  --min-spp N   samples every pixel takes before adaptive sampling decides (default: 16)\n"
+              << "  --progressive render in passes of doubling spp, saving binary.ppm after each\n"
+              << "  --time S      progressive, stopping at S seconds of rendering or at --spp, whichever is first\n"
+              << "  --split M     BVH split method, naive or sah (default: sah)\n"
+              << "  --wide        traverse 4-wide BVHs with SIMD box tests\n"
+              << "  --flatten     build one BVH over the triangles of all meshes instead of one BVH per mesh\n"
+              << "  --instances N scatter N extra instances of the bunny mesh over the floor\n"
+              << "  --panels N    hang N small emissive panels on the walls (a many-light scene)\n"
+              << "  --lights M    pick lights by area or through the light bvh (default: bvh)\n"
+              << "  --sampler M   random, sobol, pmj or bluenoise sample values (default: sobol)\n"
+              << "  --seed N      seed of the sample values; same seed, same image (default: RT_SEED or 0)\n"
+              << "  --no-mesh-cache always parse the OBJ files instead of mapping their .rtcache (also RT_NO_MESH_CACHE)\n"
+              << "  --bench-accel time closest-hit and shadow queries on nested and flattened, binary and 4-wide BVHs\n"
+              << "  --bench-obj   parse every OBJ file under ../models with ObjParser and objl, compare speed and geometry\n"
+              << "  --scaling     render with 1, 2, 4, ... threads and report the speedup per core count\n";
+}
+
+static bool parseOptions(int argc, char** argv, Options& options)
+{
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (arg == "--threads" && hasValue)
+            options.threads = std::max(1, std::atoi(argv[++i]));
+        else if (arg == "--pin")
+            options.pinThreads = true;
+        else if (arg == "--spp" && hasValue)
+            options.spp = std::max(1, std::atoi(argv[++i]));
+        else if (arg == "--strata" && hasValue)
+            options.primaryStrata = std::max(1, std::atoi(argv[++i]));
+        else if (arg == "--adaptive" && hasValue)
+            options.adaptiveThreshold = std::max(0.0, std::atof(argv[++i]));
+        else if (arg == "--min-spp" && hasValue)
+            options.adaptiveMinSpp = std::max(2, std::atoi(argv[++i]));
+        else if (arg == "--progressive")
+            options.progressive = true;
+        else if (arg == "--time" && hasValue) {
+            options.progressive = true;
+            options.timeLimit = std::max(0.0, std::atof(argv[++i]));
+        }
+        else if (arg == "--split" && hasValue && std::strcmp(argv[i + 1], "naive") == 0) {
+            options.splitMethod = BVHAccel::SplitMethod::NAIVE;
+            ++i;
+        }
+        else if (arg == "--split" && hasValue && std::strcmp(argv[i + 1], "sah") == 0) {
+            options.splitMethod = BVHAccel::SplitMethod::SAH;
+            ++i;
+        }
+        else if (arg == "--wide")
+            options.wideBVH = true;
+        else if (arg == "--flatten")
+            options.flattenBVH = true;
+        else if (arg == "--instances" && hasValue)
+            options.instances = std::max(0, std::atoi(argv[++i]));
+        else if (arg == "--panels" && hasValue)
+            options.panels = std::max(0, std::atoi(argv[++i]));
+        else if (arg == "--lights" && hasValue && std::strcmp(argv[i + 1], "area") == 0) {
+            options.lightSampling = LightSampling::AREA;
+            ++i;
+        }
+        else if (arg == "--lights" && hasValue && std::strcmp(argv[i + 1], "bvh") == 0) {
+            options.lightSampling = LightSampling::BVH;
+            ++i;
+        }
+        else if (arg == "--sampler" && hasValue && std::strcmp(argv[i + 1], "random") == 0) {
+            options.samplerType = SamplerType::RANDOM;
+            ++i;
+        }
+        else if (arg == "--sampler" && hasValue && std::strcmp(argv[i + 1], "sobol") == 0) {
+            options.samplerType = SamplerType::SOBOL;
+            ++i;
+        }
+        else if (arg == "--sampler" && hasValue && std::strcmp(argv[i + 1], "pmj") == 0) {
+            options.samplerType = SamplerType::PMJ;
+            ++i;
+        }
+        else if (arg == "--sampler" && hasValue && std::strcmp(argv[i + 1], "bluenoise") == 0) {
+            options.samplerType = SamplerType::BLUE_NOISE;
+            ++i;
+        }
+        else if (arg == "--seed" && hasValue)
+            options.seed = std::strtoul(argv[++i], nullptr, 10);
+        else if (arg == "--no-mesh-cache")
+            MeshCache::enabled = false;
+        else if (arg == "--bench-accel")
+            options.benchmarkAccel = true;
+        else if (arg == "--bench-obj")
+            options.benchmarkObj = true;
+        else if (arg == "--scaling")
+            options.scalingReport = true;
+        else {
+            printUsage(argv[0]);
+            return false;
+        }
+    }
+    return true;
+}
+
+// Render the scene once per thread count (powers of two up to options.threads)
+// and print the wall time, speedup and parallel efficiency relative to one thread.
+static void scalingReport(const Scene& scene, Renderer& r, const Options& options)
+{
+    std::vector<size_t> counts;
+    for (size_t n = 1; n < options.threads; n *= 2)
+        counts.push_back(n);
+    counts.push_back(options.threads);
+
+    double baseline = 0;
+    std::vector<std::pair<size_t, double>> timings;
+    for (size_t n : counts) {
+        TaskScheduler::init(n, options.pinThreads);
+        auto start = std::chrono::steady_clock::now();
+        r.Render(scene);
+        auto stop = std::chrono::steady_clock::now();
+        double seconds = std::chrono::duration<double>(stop - start).count();
+        if (n == 1)
+            baseline = seconds;
+        timings.emplace_back(n, seconds);
+        std::cout << "\n";
+    }
+
+    std::cout << "Scaling report (" << r.spp << " spp" << (options.pinThreads ? ", pinned" : "") << "):\n";
+    printf("%8s %12s %10s %12s\n", "threads", "time (s)", "speedup", "efficiency");
+    for (auto& [n, seconds] : timings) {
+        double speedup = baseline / seconds;
+        printf("%8zu %12.3f %10.2f %11.1f%%\n", n, seconds, speedup, 100.0 * speedup / n);
+    }
+}
+
+// Trace the same set of rays (camera rays plus one diffuse bounce and one shadow
+// ray per camera hit) through the nested (scene BVH over per-mesh BVHs) and the
+// flattened scene BVH, each as binary and 4-wide tree, and compare throughput.
+static void benchmarkAccel(Scene& scene)
+{
+    float scale = tan(deg2rad(scene.fov * 0.5));
+    float imageAspectRatio = scene.width / (float)scene.height;
+    Vector3f eye_pos(278, 273, -800);
+
+    scene.bvhOptions.wide = false;
+    scene.bvhOptions.flatten = false;
+    scene.buildBVH();
+
+    std::vector<Ray> rays, shadowRays;
+    std::unique_ptr<Sampler> sampler = Sampler::create(SamplerType::RANDOM);
+    for (int j = 0; j < scene.height; ++j) {
+        for (int i = 0; i < scene.width; ++i) {
+            float x = (2 * (i + 0.5) / (float)scene.width - 1) * imageAspectRatio * scale;
+            float y = (1 - 2 * (j + 0.5) / (float)scene.height) * scale;
+            Ray ray(eye_pos, normalize(Vector3f(-x, y, 1)));
+            rays.push_back(ray);
+            Intersection hit = scene.intersect(ray);
+            if (!hit.happened)
+                continue;
+            // cosine-weighted bounce around the normal, and a segment towards the light
+            Material bounce(DIFFUSE, Vector3f(0.0f), IS_COSWEIGHTED);
+            rays.emplace_back(hit.coords, bounce.sample(-ray.direction, hit.normal, *sampler));
+            Vector3f toLight = Vector3f(278, 548, 279.5) - hit.coords;
+            Ray shadow(hit.coords, normalize(toLight));
+            shadow.t_max = toLight.norm() * 0.999f;
+            shadowRays.push_back(shadow);
+        }
+    }
+
+    std::vector<double> distances[4];
+    for (int config = 0; config < 4; ++config) {
+        bool flatten = config / 2, wide = config % 2;
+        scene.bvhOptions.flatten = flatten;
+        scene.bvhOptions.wide = wide;
+        scene.buildBVH();
+        const int repeats = 5;
+        size_t occluded = 0;
+        auto start = std::chrono::steady_clock::now();
+        for (int k = 0; k < repeats; ++k) {
+            distances[config].clear();
+            for (auto& ray : rays)
+                distances[config].push_back(scene.intersect(ray).distance);
+        }
+        auto mid = std::chrono::steady_clock::now();
+        for (int k = 0; k < repeats; ++k)
+            for (auto& ray : shadowRays)
+                occluded += scene.bvh->IntersectP(ray);
+        auto stop = std::chrono::steady_clock::now();
+        double closest = std::chrono::duration<double>(mid - start).count();
+        double shadow = std::chrono::duration<double>(stop - mid).count();
+        printf("%s %s BVH: closest hit %.2f Mrays/s, shadow %.2f Mrays/s (%zu occluded)\n",
+               flatten ? "flattened" : "nested", wide ? "4-wide" : "binary", repeats * rays.size() / closest * 1e-6,
+               repeats * shadowRays.size() / shadow * 1e-6, occluded / repeats);
+    }
+    size_t mismatches = 0;
+    for (size_t i = 0; i < rays.size(); ++i)
+        for (int config = 1; config < 4; ++config)
+            mismatches += distances[0][i] != distances[config][i];
+    printf("%zu rays, %zu hit distances differ from the nested binary BVH\n", rays.size(), mismatches);
+}
+
+// Parse every OBJ file under dir with ObjParser and with objl::Loader, report the
+// throughput of both and check that they produce the same triangles.
+static void benchmarkObj(const std::string& dir)
+{
+    std::vector<std::string> paths;
+    for (auto& entry : std::filesystem::recursive_directory_iterator(dir))
+        if (entry.path().extension() == ".obj")
+            paths.push_back(entry.path().string());
+    std::sort(paths.begin(), paths.end());
+
+    printf("%-36s %10s %14s %14s %s\n", "file", "faces", "ObjParser", "objl", "geometry");
+    for (auto& path : paths) {
+        ObjParser parser;
+        const int repeats = 5;
+        auto start = std::chrono::steady_clock::now();
+        bool ok = true;
+        for (int k = 0; k < repeats; ++k)
+            ok = parser.parse(path) && ok;
+        auto mid = std::chrono::steady_clock::now();
+        objl::Loader loader;
+        for (int k = 0; k < repeats; ++k) {
+            loader = objl::Loader();
+            loader.LoadFile(path);
+        }
+        auto stop = std::chrono::steady_clock::now();
+        if (!ok) {
+            printf("%-36s %s\n", path.c_str(), parser.error.c_str());
+            continue;
+        }
+
+        // compare the corner positions of every triangle in file order
+        std::vector<Vector3f> reference;
+        for (auto& mesh : loader.LoadedMeshes) {
+            for (unsigned index : mesh.Indices) {
+                auto& p = mesh.Vertices[index].Position;
+                reference.emplace_back(p.X, p.Y, p.Z);
+            }
+        }
+        bool same = reference.size() == parser.indices.size();
+        for (size_t i = 0; same && i < reference.size(); ++i) {
+            const Vector3f& v = parser.vertices[parser.indices[i]];
+            same = v.x == reference[i].x && v.y == reference[i].y && v.z == reference[i].z;
+        }
+        double mb = repeats * parser.bytes * 1e-6;
+        printf("%-36s %10zu %9.1f MB/s %9.1f MB/s %s\n", path.c_str(), parser.indices.size() / 3,
+               mb / std::chrono::duration<double>(mid - start).count(),
+               mb / std::chrono::duration<double>(stop - mid).count(), same ? "identical" : "DIFFERENT");
+    }
+}
+
+// count small square emitters on the back and side walls of the Cornell box, all
+// in one mesh with a few emission colors; the faces face into the box.
+static std::unique_ptr<Mesh> makeLightPanels(int count, const std::vector<Material*>& materials)
+{
+    std::vector<Vector3f> vertices;
+    std::vector<uint32_t> indices;
+    TriangleMesh geometry;
+    geometry.materials = materials;
+    // fixed seed, the same scene on every run
+    uint32_t state = 12345;
+    auto next = [&state] {
+        state = state * 1664525u + 1013904223u;
+        return (state >> 8) * (1.0f / 16777216.0f);
+    };
+    const float half = 8;
+    for (int k = 0; k < count; ++k) {
+        // tangents a, b with a x b pointing into the box
+        Vector3f c, a, b;
+        float s = 40 + 460 * next(), t = 40 + 460 * next();
+        switch (k % 3) {
+        case 0: c = Vector3f(s, t, 558.5f); a = Vector3f(0, half, 0); b = Vector3f(half, 0, 0); break;
+        case 1: c = Vector3f(0.5f, t, s);   a = Vector3f(0, half, 0); b = Vector3f(0, 0, half); break;
+        default: c = Vector3f(545, t, s);   a = Vector3f(0, 0, half); b = Vector3f(0, half, 0); break;
+        }
+        uint32_t first = vertices.size();
+        vertices.push_back(c - a - b);
+        vertices.push_back(c + a - b);
+        vertices.push_back(c + a + b);
+        vertices.push_back(c - a + b);
+        for (uint32_t i : {0, 1, 2, 0, 2, 3})
+            indices.push_back(first + i);
+        uint16_t material = next() * materials.size();
+        geometry.faceMaterials.push_back(material);
+        geometry.faceMaterials.push_back(material);
+    }
+    geometry.own(std::move(vertices), std::move(indices));
+    return std::make_unique<Mesh>(std::move(geometry));
+}
 
 // In the main function of the program, we create the scene (create objects and
 // lights) as well as set the options for the render (image width and height,
@@ -12,6 +335,15 @@
 // function().
 int main(int argc, char** argv)
 {
+    Options options;
+    if (!parseOptions(argc, argv, options))
+        return 1;
+    TaskScheduler::init(options.threads, options.pinThreads);
+    std::cout << "Threads: " << options.threads << (options.pinThreads ? " (pinned)" : "") << "\n";
+    if (options.benchmarkObj) {
+        benchmarkObj("../models");
+        return 0;
+    }
 
     // Change the definition here to change resolution
     Scene scene(256, 256);
@@ -26,7 +358,7 @@ int main(int argc, char** argv)
     // Material* light = new Material(DIFFUSE, (8.0f * Vector3f(0.747f+0.058f, 0.747f+0.258f, 0.747f) + 15.6f * Vector3f(0.740f+0.287f,0.740f+0.160f,0.740f) + 18.4f *Vector3f(0.737f+0.642f,0.737f+0.159f,0.737f)));
     // light->Kd = Vector3f(0.65f);
 
-    SamplingType st = IS_COSWEIGHTED;
+    SamplingType st = IS_MIXTURE;
 
     Material* red = new Material(MICROFACET, Vector3f(0.0f), st);
     red->rho = Vector3f(0.63f, 0.065f, 0.05f);
@@ -92,30 +424,77 @@ int main(int argc, char** argv)
     water->alpha = 0.1f;
     water->ks = 0.9f;
 
-    Mesh floor("../models/cornellbox/floor.obj", white);
-    // Mesh shortbox("../models/cornellbox/shortbox.obj", white);
-    // Mesh tallbox("../models/cornellbox/tallbox.obj", white);
-    Mesh left("../models/cornellbox/left.obj", red);
-    Mesh right("../models/cornellbox/right.obj", green);
-    Mesh light_("../models/cornellbox/light.obj", light);
+    scene.bvhOptions.splitMethod = options.splitMethod;
+    scene.bvhOptions.wide = options.wideBVH;
+    scene.bvhOptions.flatten = options.flattenBVH;
 
-    Mesh bunny("../models/bunny/bunny4.obj", gold);
-    // Mesh shortbox("../models/cornellbox/shortbox.obj", plastic);
-    Mesh tallbox("../models/cornellbox/tallbox.obj", silver);
+    // the meshes are parsed and get their BVHs concurrently, they are added to
+    // the scene in this order
+    SceneLoader loader(scene);
+    loader.load("../models/cornellbox/floor.obj", white);
+    // loader.load("../models/cornellbox/shortbox.obj", white);
+    // loader.load("../models/cornellbox/tallbox.obj", white);
+    loader.load("../models/cornellbox/left.obj", red);
+    loader.load("../models/cornellbox/right.obj", green);
 
-    scene.Add(&floor);
-    scene.Add(&left);
-    scene.Add(&right);
+    size_t bunnyIndex = loader.load("../models/bunny/bunny4.obj", gold);
+    // loader.load("../models/cornellbox/shortbox.obj", plastic);
+    loader.load("../models/cornellbox/tallbox.obj", silver);
 
-    scene.Add(&bunny);
-    // scene.Add(&shortbox);
-    scene.Add(&tallbox);
+    loader.load("../models/cornellbox/light.obj", light);
+    loader.wait();
+    Mesh& bunny = loader.mesh(bunnyIndex);
 
-    scene.Add(&light_);
+    // extra copies of the bunny share its triangles and BVH, only the transforms differ
+    std::vector<std::unique_ptr<Instance>> instances;
+    if (options.instances > 0) {
+        Bounds3 b = bunny.getBounds();
+        Vector3f base(0.5f * (b.pMin.x + b.pMax.x), b.pMin.y, 0.5f * (b.pMin.z + b.pMax.z));
+        int cols = std::ceil(std::sqrt((float)options.instances));
+        float cell = 496.0f / cols;
+        float s = 0.8f * cell / std::max(b.Diagonal().x, b.Diagonal().z);
+        for (int k = 0; k < options.instances; ++k) {
+            Vector3f pos(30 + cell * (k % cols + 0.5f), 0, 30 + cell * (k / cols + 0.5f));
+            Transform toWorld = Transform::translate(pos) * Transform::rotateY(37.0f * k) *
+                                Transform::scale(Vector3f(s)) * Transform::translate(-base);
+            instances.emplace_back(new Instance(&bunny, toWorld, k % 2 ? silver : gold));
+            scene.Add(instances.back().get());
+        }
+    }
+
+    std::unique_ptr<Mesh> panels;
+    if (options.panels > 0) {
+        std::vector<Material*> panelMaterials;
+        for (Vector3f emission : {Vector3f(6, 3.5f, 1.5f), Vector3f(1.5f, 3, 6), Vector3f(4, 4, 4)}) {
+            panelMaterials.push_back(new Material(MICROFACET, emission, st));
+            panelMaterials.back()->rho = Vector3f(0.65f);
+        }
+        panels = makeLightPanels(options.panels, panelMaterials);
+        scene.Add(panels.get());
+    }
+    scene.lightSampling = options.lightSampling;
+
+    if (options.benchmarkAccel) {
+        benchmarkAccel(scene);
+        return 0;
+    }
 
     scene.buildBVH();
 
     Renderer r;
+    r.spp = options.spp;
+    r.primaryStrata = options.primaryStrata;
+    r.samplerType = options.samplerType;
+    r.seed = options.seed;
+    r.adaptiveThreshold = options.adaptiveThreshold;
+    r.adaptiveMinSpp = options.adaptiveMinSpp;
+    r.progressive = options.progressive;
+    r.timeLimit = options.timeLimit;
+
+    if (options.scalingReport) {
+        scalingReport(scene, r, options);
+        return 0;
+    }
 
     auto start = std::chrono::system_clock::now();
     r.Render(scene);